@@ -0,0 +1,668 @@
+#include "comparer.h"
+#include <iostream>
+#include <charconv>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+
+// Drives the merge and diff code with generated rows rather than with queries, so its
+// throughput can be measured without a server.
+
+static constexpr uint64_t KEY_PART_BASE = 1000;
+
+enum class gen_type {
+	int32,
+	int64,
+	float64,
+	varchar,
+	nvarchar,
+	varbinary
+};
+
+enum class key_dist {
+	sequential,
+	sparse,
+	clustered
+};
+
+static uint64_t num_rows = 1000000;
+static unsigned int num_columns = 8;
+static vector<gen_type> col_types{ gen_type::int32, gen_type::int64, gen_type::float64, gen_type::varchar };
+static size_t col_width = 32;
+static double changed_rate = 0.01, added_rate = 0.001, removed_rate = 0.001;
+static double null_rate = 0.05;
+static key_dist keys = key_dist::sequential;
+static bool string_keys = false;
+static bool legacy = false;
+static bool memory_sink = false;
+static bool unsorted = false;
+static bool keyless = false;
+static unsigned int writers = 1;
+static uint64_t seed = 1;
+static unsigned int key_columns = 1;
+static string file1, file2, save_prefix, snapshot_prefix;
+
+static atomic<uint64_t> allocations = 0;
+
+void* operator new(size_t size) {
+	allocations.fetch_add(1, memory_order_relaxed);
+
+	if (auto p = malloc(size == 0 ? 1 : size))
+		return p;
+
+	throw bad_alloc();
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+	free(p);
+}
+
+void operator delete[](void* p) noexcept {
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+	free(p);
+}
+
+static uint64_t splitmix64(uint64_t& x) noexcept {
+	uint64_t z = (x += 0x9e3779b97f4a7c15);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+
+	return z ^ (z >> 31);
+}
+
+static double uniform(uint64_t& x) noexcept {
+	return (double)(splitmix64(x) >> 11) * 0x1.0p-53;
+}
+
+static vector<tds::column> make_columns() {
+	vector<tds::column> cols;
+
+	auto add = [&](tds::value v, unsigned int max_length, u16string_view name) {
+		auto& c = cols.emplace_back();
+
+		static_cast<tds::value&>(c) = v;
+		c.val.clear();
+		c.is_null = false;
+		c.name = name;
+		c.nullable = true;
+
+		if (max_length != 0)
+			c.max_length = max_length;
+	};
+
+	for (unsigned int i = 0; i < key_columns; i++) {
+		auto name = key_columns == 1 ? u16string(u"id") : tds::utf8_to_utf16(format("id{}", i + 1));
+
+		if (string_keys)
+			add(tds::value(string_view{}), 20, name);
+		else
+			add(tds::value((int64_t)0), 0, name);
+	}
+
+	for (unsigned int i = 0; i < num_columns; i++) {
+		auto name = tds::utf8_to_utf16(format("col{}", i + 1));
+		auto width = (unsigned int)col_width;
+
+		switch (col_types[i % col_types.size()]) {
+			case gen_type::int32:
+				add(tds::value((int32_t)0), 0, name);
+				break;
+
+			case gen_type::int64:
+				add(tds::value((int64_t)0), 0, name);
+				break;
+
+			case gen_type::float64:
+				add(tds::value(0.0), 0, name);
+				break;
+
+			case gen_type::varchar:
+				add(tds::value(string_view{}), width, name);
+				break;
+
+			case gen_type::nvarchar:
+				add(tds::value(u16string_view{}), width * 2, name);
+				break;
+
+			case gen_type::varbinary:
+				add(tds::value(span<const byte>{}), width, name);
+				break;
+		}
+	}
+
+	return cols;
+}
+
+// Fills val with len characters or bytes made from v. Resizing keeps the capacity, so
+// this doesn't allocate once the row has been through a few values.
+
+static void fill_bytes(tds::value_data_t& val, uint64_t v, size_t len, size_t char_size, bool text) {
+	val.resize(len * char_size);
+
+	for (size_t i = 0; i < len; i++) {
+		if (i % 8 == 0)
+			splitmix64(v);
+
+		auto b = (uint8_t)(v >> ((i % 8) * 8));
+
+		val[i * char_size] = text ? (uint8_t)('a' + (b % 26)) : b;
+
+		if (char_size == 2)
+			val[(i * char_size) + 1] = 0;
+	}
+}
+
+// Produces one side of the compare. Each row's values come from a generator seeded by
+// its row number, so the two sides agree except where a row has been picked to differ.
+
+class synthetic_source : public row_source {
+public:
+	synthetic_source(bool second) : second(second) {
+	}
+
+	vector<tds::column> open() override {
+		row = make_columns();
+
+		return row;
+	}
+
+	bool fetch_row() override;
+
+	void add_row(row_batch& b) override {
+		b.add_row(row);
+	}
+
+	vector<tds::column> row;
+
+private:
+	bool generate_row();
+
+	bool second;
+	uint64_t i = 0, key = 0;
+};
+
+// Returns false if row i is only on the other side.
+
+bool synthetic_source::generate_row() {
+	uint64_t r = seed ^ (i * 0xd1342543de82ef95);
+
+	switch (keys) {
+		case key_dist::sequential:
+			key = i;
+			break;
+
+		case key_dist::sparse:
+			key += 1 + (splitmix64(r) % 1000);
+			break;
+
+		case key_dist::clustered:
+			key += splitmix64(r) % 100 == 0 ? 1000000 : 1;
+			break;
+	}
+
+	i++;
+
+	// every draw is made on both sides, so that they stay in step
+
+	auto fate = uniform(r);
+	auto changed_col = splitmix64(r) % num_columns;
+	auto removed = fate < removed_rate;
+	auto added = !removed && fate < removed_rate + added_rate;
+	auto changed = !removed && !added && fate < removed_rate + added_rate + changed_rate;
+
+	if ((removed && second) || (added && !second))
+		return false;
+
+	// With more than one key column, the key is split into digits of KEY_PART_BASE,
+	// most significant first, so that the rows are still in order of the whole key.
+
+	auto rest = key;
+
+	for (unsigned int k = key_columns; k-- > 0;) {
+		auto part = k == 0 ? rest : rest % KEY_PART_BASE;
+
+		rest /= KEY_PART_BASE;
+
+		if (string_keys) {
+			auto s = format("{:020}", part);
+
+			row[k].val.assign(s.begin(), s.end());
+		} else {
+			row[k].val.resize(sizeof(int64_t));
+			memcpy(row[k].val.data(), &part, sizeof(int64_t));
+		}
+	}
+
+	for (unsigned int j = 0; j < num_columns; j++) {
+		auto& c = row[j + key_columns];
+		auto v = splitmix64(r);
+		auto is_null = uniform(r) < null_rate;
+
+		if (changed && second && j == changed_col) {
+			if (is_null)
+				is_null = false;
+			else
+				v = ~v;
+		}
+
+		c.is_null = is_null;
+
+		if (is_null) {
+			c.val.clear();
+			continue;
+		}
+
+		switch (col_types[j % col_types.size()]) {
+			case gen_type::int32: {
+				auto n = (int32_t)v;
+
+				c.val.resize(sizeof(n));
+				memcpy(c.val.data(), &n, sizeof(n));
+				break;
+			}
+
+			case gen_type::int64:
+				c.val.resize(sizeof(v));
+				memcpy(c.val.data(), &v, sizeof(v));
+				break;
+
+			case gen_type::float64: {
+				auto d = (double)(v >> 11) * 0x1.0p-33;
+
+				c.val.resize(sizeof(d));
+				memcpy(c.val.data(), &d, sizeof(d));
+				break;
+			}
+
+			case gen_type::varchar:
+				fill_bytes(c.val, v, (col_width / 2) + (v % ((col_width / 2) + 1)), 1, true);
+				break;
+
+			case gen_type::nvarchar:
+				fill_bytes(c.val, v, (col_width / 2) + (v % ((col_width / 2) + 1)), 2, true);
+				break;
+
+			case gen_type::varbinary:
+				fill_bytes(c.val, v, (col_width / 2) + (v % ((col_width / 2) + 1)), 1, false);
+				break;
+		}
+	}
+
+	return true;
+}
+
+bool synthetic_source::fetch_row() {
+	while (i < num_rows) {
+		if (generate_row())
+			return true;
+	}
+
+	return false;
+}
+
+// Either drops the differences, or turns them into rows the way the bcp writers would.
+
+class bench_sink : public diff_sink {
+public:
+	bench_sink(unsigned int writers) {
+		start(writers);
+	}
+
+	~bench_sink() {
+		join();
+	}
+
+	atomic<uint64_t> records = 0;
+
+protected:
+	function<void(diff_arena&)> writer() override {
+		if (!memory_sink) {
+			return [this](diff_arena& a) noexcept {
+				records += a.records.size();
+			};
+		}
+
+		auto rows = make_shared<vector<vector<tds::value>>>();
+
+		return [this, rows](diff_arena& a) {
+			auto write_start = chrono::steady_clock::now();
+
+			for (size_t start = 0; start < a.records.size(); start += 10000) {
+				rows->resize(min<size_t>(a.records.size() - start, 10000));
+
+				for (size_t i = 0; i < rows->size(); i++) {
+					diff_row((*rows)[i], a, a.records[start + i], legacy);
+				}
+
+				rows_written += rows->size();
+			}
+
+			records += a.records.size();
+			write_ns += elapsed_ns(write_start);
+		};
+	}
+};
+
+static size_t peak_memory() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return 0;
+
+	return pmc.PeakWorkingSetSize;
+#else
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return 0;
+
+	return (size_t)ru.ru_maxrss * 1024;
+#endif
+}
+
+// Either side can be read from a file instead, e.g. one written by --save.
+
+static unique_ptr<row_source> make_source(const string& file, bool second) {
+	if (!file.empty())
+		return open_file_source(file);
+
+	return make_unique<synthetic_source>(second);
+}
+
+// Writes the generated rows out in the binary format, rather than comparing them.
+
+static void save_files() {
+	for (unsigned int i = 0; i < 2; i++) {
+		synthetic_source src(i == 1);
+		auto cols = src.open();
+		binary_writer w(format("{}{}.bin", save_prefix, i + 1), cols);
+
+		while (src.fetch_row()) {
+			w.write_row(src.row);
+		}
+	}
+}
+
+// Writes the generated rows out as snapshots, going through sql_thread as a compare would.
+
+static void save_snapshots() {
+	for (unsigned int i = 0; i < 2; i++) {
+		snapshot_writer w(format("{}{}.snap", snapshot_prefix, i + 1));
+
+		{
+			sql_thread t(make_unique<synthetic_source>(i == 1), &w);
+			batch_cursor s(t);
+
+			while (s.next_batch()) {
+			}
+		}
+
+		w.finish();
+	}
+}
+
+static void run_bench() {
+	compare_stats stats;
+	auto allocs_before = allocations.load();
+	auto start = chrono::steady_clock::now();
+	uint64_t records, write_ns;
+
+	{
+		auto pk_columns = keyless ? 0 : key_columns; // with --keyless the whole row is the key
+		auto check_keys = unsorted ? 0 : pk_columns; // only files need their order checking
+
+		sql_thread t1(make_source(file1, false), nullptr, file1.empty() ? 0 : check_keys);
+		sql_thread t2(make_source(file2, true), nullptr, file2.empty() ? 0 : check_keys);
+		bench_sink b(writers);
+
+		if (unsorted && legacy)
+			compare_unsorted<false>(t1, t2, b, stats, 0, pk_columns, false, filesystem::temp_directory_path(),
+									 mem_budget.limit / 4);
+		else if (unsorted)
+			compare_unsorted<true>(t1, t2, b, stats, 0, pk_columns, false, filesystem::temp_directory_path(),
+									 mem_budget.limit / 4);
+		else if (legacy)
+			compare_range<false>(t1, t2, b, stats, 0, pk_columns, false);
+		else
+			compare_range<true>(t1, t2, b, stats, 0, pk_columns, false);
+
+		b.join();
+
+		if (b.exc)
+			rethrow_exception(b.exc);
+
+		records = b.records;
+		write_ns = b.write_ns;
+	}
+
+	auto secs = (double)elapsed_ns(start) / 1e9;
+	auto allocs = allocations.load() - allocs_before;
+	auto rows = (double)stats.rows1 + (double)stats.rows2;
+	auto bytes = (double)stats.bytes1 + (double)stats.bytes2;
+
+	cout << format("rows: {} + {} ({} changed, {} added, {} removed)\n", stats.rows1.load(), stats.rows2.load(),
+				   stats.changed_rows.load(), stats.added_rows.load(), stats.removed_rows.load());
+	cout << format("diff records: {}\n", records);
+	cout << format("elapsed: {:.3f} s\n", secs);
+	cout << format("throughput: {:.0f} rows/s, {:.1f} MB/s\n", rows / secs, bytes / secs / 1048576.0);
+	cout << format("merge: {:.3f} s, waiting on sink: {:.3f} s, sink: {:.3f} s\n", (double)stats.merge_ns / 1e9,
+				   (double)stats.send_wait_ns / 1e9, (double)write_ns / 1e9);
+	cout << format("allocations: {} ({:.3f} per row)\n", allocs, rows == 0 ? 0.0 : (double)allocs / rows);
+	cout << format("peak memory: {} MB\n", peak_memory() / 1048576);
+}
+
+template<typename T>
+static bool parse_number(string_view sv, T& t) {
+	auto [ptr, ec] = from_chars(sv.data(), sv.data() + sv.length(), t);
+
+	if (ec != errc() || ptr != sv.data() + sv.length()) {
+		cerr << format("Could not convert \"{}\" to number.\n", sv);
+		return false;
+	}
+
+	return true;
+}
+
+static bool parse_rate(string_view sv, double& d) {
+	if (!parse_number(sv, d))
+		return false;
+
+	if (d < 0.0 || d > 1.0) {
+		cerr << format("Rate \"{}\" must be between 0 and 1.\n", sv);
+		return false;
+	}
+
+	return true;
+}
+
+static bool parse_types(string_view sv) {
+	col_types.clear();
+
+	while (!sv.empty()) {
+		auto comma = sv.find(',');
+		auto t = sv.substr(0, comma);
+
+		if (t == "int")
+			col_types.push_back(gen_type::int32);
+		else if (t == "bigint")
+			col_types.push_back(gen_type::int64);
+		else if (t == "float")
+			col_types.push_back(gen_type::float64);
+		else if (t == "varchar")
+			col_types.push_back(gen_type::varchar);
+		else if (t == "nvarchar")
+			col_types.push_back(gen_type::nvarchar);
+		else if (t == "varbinary")
+			col_types.push_back(gen_type::varbinary);
+		else {
+			cerr << format("Unrecognized column type \"{}\".\n", t);
+			return false;
+		}
+
+		if (comma == string_view::npos)
+			break;
+
+		sv = sv.substr(comma + 1);
+	}
+
+	if (col_types.empty()) {
+		cerr << "At least one column type must be given." << endl;
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	for (int i = 1; i < argc; i++) {
+		auto sv = string_view(argv[i]);
+		auto arg = sv.substr(sv.find('=') + 1);
+
+		if (sv.starts_with("--rows=")) {
+			if (!parse_number(arg, num_rows))
+				return 1;
+		} else if (sv.starts_with("--columns=")) {
+			if (!parse_number(arg, num_columns))
+				return 1;
+
+			if (num_columns == 0) {
+				cerr << "Number of columns must be at least 1." << endl;
+				return 1;
+			}
+		} else if (sv.starts_with("--types=")) {
+			if (!parse_types(arg))
+				return 1;
+		} else if (sv.starts_with("--width=")) {
+			if (!parse_number(arg, col_width))
+				return 1;
+
+			if (col_width == 0) {
+				cerr << "Column width must be at least 1." << endl;
+				return 1;
+			}
+		} else if (sv.starts_with("--changed=")) {
+			if (!parse_rate(arg, changed_rate))
+				return 1;
+		} else if (sv.starts_with("--added=")) {
+			if (!parse_rate(arg, added_rate))
+				return 1;
+		} else if (sv.starts_with("--removed=")) {
+			if (!parse_rate(arg, removed_rate))
+				return 1;
+		} else if (sv.starts_with("--nulls=")) {
+			if (!parse_rate(arg, null_rate))
+				return 1;
+		} else if (sv.starts_with("--keys=")) {
+			if (arg == "sequential")
+				keys = key_dist::sequential;
+			else if (arg == "sparse")
+				keys = key_dist::sparse;
+			else if (arg == "clustered")
+				keys = key_dist::clustered;
+			else {
+				cerr << format("Unrecognized key distribution \"{}\".\n", arg);
+				return 1;
+			}
+		} else if (sv.starts_with("--sink=")) {
+			if (arg == "discard")
+				memory_sink = false;
+			else if (arg == "memory")
+				memory_sink = true;
+			else {
+				cerr << format("Unrecognized sink \"{}\".\n", arg);
+				return 1;
+			}
+		} else if (sv.starts_with("--writers=")) {
+			if (!parse_number(arg, writers))
+				return 1;
+
+			if (writers == 0) {
+				cerr << "Number of writers must be at least 1." << endl;
+				return 1;
+			}
+		} else if (sv.starts_with("--memory=")) {
+			size_t mb;
+
+			if (!parse_number(arg, mb))
+				return 1;
+
+			if (mb == 0) {
+				cerr << "Memory budget must be at least 1 MB." << endl;
+				return 1;
+			}
+
+			mem_budget.limit = mb * 1048576;
+		} else if (sv.starts_with("--seed=")) {
+			if (!parse_number(arg, seed))
+				return 1;
+		} else if (sv.starts_with("--key-columns=")) {
+			if (!parse_number(arg, key_columns))
+				return 1;
+
+			if (key_columns == 0) {
+				cerr << "Number of key columns must be at least 1." << endl;
+				return 1;
+			}
+		} else if (sv.starts_with("--file1="))
+			file1 = arg;
+		else if (sv.starts_with("--file2="))
+			file2 = arg;
+		else if (sv.starts_with("--save="))
+			save_prefix = arg;
+		else if (sv.starts_with("--save-snapshot="))
+			snapshot_prefix = arg;
+		else if (sv == "--string-keys")
+			string_keys = true;
+		else if (sv == "--unsorted")
+			unsorted = true;
+		else if (sv == "--keyless")
+			keyless = true;
+		else if (sv == "--legacy")
+			legacy = true;
+		else {
+			cerr << format("Unrecognized option \"{}\".\n", sv);
+			cerr << "Usage: comparer_bench [--rows=<n>] [--columns=<n>] [--types=<int|bigint|float|varchar|nvarchar|varbinary,...>] [--width=<n>] [--changed=<rate>] [--added=<rate>] [--removed=<rate>] [--nulls=<rate>] [--keys=<sequential|sparse|clustered>] [--string-keys] [--legacy] [--unsorted] [--keyless] [--sink=<discard|memory>] [--writers=<n>] [--memory=<MB>] [--seed=<n>] [--file1=<file>] [--file2=<file>] [--key-columns=<n>] [--save=<prefix>] [--save-snapshot=<prefix>]" << endl;
+			return 1;
+		}
+	}
+
+	if (changed_rate + added_rate + removed_rate > 1.0) {
+		cerr << "Changed, added and removed rates must add up to no more than 1." << endl;
+		return 1;
+	}
+
+	try {
+		if (!save_prefix.empty())
+			save_files();
+		else if (!snapshot_prefix.empty())
+			save_snapshots();
+		else
+			run_bench();
+	} catch (const exception& e) {
+		cerr << "Exception: " << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -4,102 +4,73 @@
 #include <mutex>
 #include <array>
 #include <charconv>
-#include <numeric>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <semaphore>
+#include <thread>
 
 using namespace std;
 
 static constexpr string_view DB_APP = "Janus";
 
-// FIXME - calculate this dynamically?
+// tdscpp stops reading from the socket once rate_limit packets are buffered, which is
+// set from the memory budget when connecting.
+static constexpr unsigned int MIN_PACKETS = 64;
 static constexpr unsigned int MAX_PACKETS = 262144; // 1 GB
-
-static unsigned int log_id = 0;
+static constexpr size_t PACKET_SIZE = 4096;
+static constexpr chrono::seconds REPORT_INTERVAL{2};
+static constexpr unsigned int DEFAULT_WORKERS = 4;
+static constexpr chrono::seconds DEFAULT_POLL_INTERVAL{5};
+static constexpr chrono::seconds CLAIM_HEARTBEAT{60};
+static constexpr unsigned int CLAIM_TIMEOUT = 300; // seconds without a heartbeat before a claim is taken over
+
+static unsigned int parallel_ranges = 1;
+static unsigned int bcp_writers = 1;
+static unsigned int batch_workers = 1;
+static chrono::seconds poll_interval = DEFAULT_POLL_INTERVAL;
+static bool checksum_mode = false;
+static bool incremental_mode = false;
+static bool two_phase_mode = false;
+static bool staging_mode = false;
+static bool unsorted_mode = false;
+static string stats_json;
+static string file1, file2;
+static string save_snapshot;
+static filesystem::path spill_dir;
 static string db_server, db_username, db_password;
 
-sql_thread::sql_thread(u16string_view query, unique_ptr<tds::tds>& tds) : finished(false), query(query), uptds(move(tds)) {
-	t = jthread([&](stop_token stop, sql_thread* st) noexcept {
-		st->run(stop);
-	}, this);
-}
-
-void sql_thread::run(stop_token stop) noexcept {
-	try {
-		auto& tds = *uptds.get();
-
-		tds::query sq(tds, tds::no_check{query});
-
-		auto num_col = sq.num_columns();
-
-		cols.reserve(num_col);
-
-		for (uint16_t i = 0; i < num_col; i++) {
-			cols.emplace_back(sq[i]);
-		}
-
-		auto b = sq.fetch_row();
-
-		if (b) {
-			do {
-				{
-					unique_lock ul(lock);
-
-					cv.wait(ul, [&]() { return results.size() <= 100000 || finished || stop.stop_requested(); });
-				}
-
-				if (finished || stop.stop_requested())
-					break;
-
-				decltype(results) l;
-
-				do {
-					l.emplace_back();
-					auto& v = l.back();
-
-					v.reserve(num_col);
-
-					for (uint16_t i = 0; i < num_col; i++) {
-						v.emplace_back();
-
-						auto& vb = v.back();
-
-						vb.first.swap(sq[i].val);
-						vb.second = sq[i].is_null;
-					}
-				} while (sq.fetch_row_no_wait());
-
-				{
-					lock_guard<mutex> guard(lock);
-
-					results.splice(results.end(), l);
-				}
-
-				cv.notify_all();
-			} while (!finished && !stop.stop_requested() && sq.fetch_row());
-		}
-	} catch (...) {
-		ex = current_exception();
-	}
+// With several compares running at once, the connections open to each source server, and
+// the bcps running against the results, are limited across all of them.
 
-	finished = true;
+struct connection_limits {
+	void acquire(const vector<string>& servers);
+	void release(const vector<string>& servers) noexcept;
 
-	lock_guard<mutex> guard(lock);
-	cv.notify_all();
-}
+	unsigned int limit = 0; // per server, or 0 for no limit
+	map<string, unsigned int> open;
+	mutex lock;
+	condition_variable cv;
+};
 
-sql_thread::~sql_thread() {
-	t.request_stop();
-	cv.notify_all();
-}
+// In service mode, connections are kept open between compares rather than logging in
+// afresh each time. Otherwise get just connects, and put just disconnects.
 
-void sql_thread::wait_for(const invocable auto& func) {
-	unique_lock<mutex> ul(lock);
+struct connection_pool {
+	unique_ptr<tds::tds> get(const string& server, unsigned int rate_limit);
+	void put(const string& server, unsigned int rate_limit, unique_ptr<tds::tds> conn) noexcept;
 
-	cv.wait(ul, [&]() {
-		return finished || !results.empty();
-	});
+	bool enabled = false;
+	map<pair<string, unsigned int>, list<unique_ptr<tds::tds>>> idle;
+	mutex lock;
+};
 
-	func();
-}
+static connection_limits server_connections;
+static connection_pool connections;
+static unique_ptr<counting_semaphore<>> bcp_slots;
 
 static string sanitize_identifier(string_view sv) {
 	if (sv.empty() || sv.front() != '[')
@@ -132,15 +103,53 @@ static u16string to_u16string(const T& t) {
 	return tds::utf8_to_utf16(std::to_string(t));
 }
 
+// Returns the key of a per-query results table, as a bracketed list of columns.
+
+static u16string results_key(const vector<pk_col>& pk, bool pk_only) {
+	u16string q = u"(";
+	bool first = true;
+
+	for (const auto& p : pk) {
+		if (!first)
+			q += u", ";
+
+		q += tds::escape(p.name);
+
+		if (p.desc)
+			q += u" DESC";
+
+		first = false;
+	}
+
+	if (pk_only)
+		q += u")";
+	else
+		q += u", col)";
+
+	return q;
+}
+
+// If any key columns are nullable, the table gets a unique index rather than a primary key.
+
+static bool results_unique_key(const vector<pk_col>& pk) {
+	return any_of(pk.begin(), pk.end(), [](const auto& p) {
+		return p.nullable;
+	});
+}
+
+// When staged is set, the table is created as a heap under another name, for
+// finish_staged_results to index and rename once it's been loaded.
+
 static void create_results_table(tds::tds& tds, const vector<pk_col>& pk,
 								 unsigned int num, u16string& results_table,
-								 bool pk_only) {
+								 bool pk_only, bool staged = false) {
 	u16string q;
-	bool do_unique_key = false;
 
 	// FIXME - name collisions
 
-	results_table = u"Comparer.results" + to_u16string(num);
+	auto name = u"results" + to_u16string(num) + (staged ? u"_staging" : u"");
+
+	results_table = u"Comparer." + name;
 
 	q = u"CREATE TABLE " + results_table + u" (\n";
 
@@ -150,45 +159,30 @@ static void create_results_table(tds::tds& tds, const vector<pk_col>& pk,
 		q += u" ";
 		q += p.nullable ? u"NULL" : u"NOT NULL";
 		q += u",\n";
-
-		if (p.nullable)
-			do_unique_key = true;
 	}
 
-	q += u"change VARCHAR(10) NOT NULL,\n";
+	q += u"change VARCHAR(10) NOT NULL";
 
 	if (!pk_only) {
+		q += u",\n";
 		q += u"col SMALLINT NOT NULL,\n";
 		q += u"col_name VARCHAR(128) NOT NULL,\n";
 		q += u"value1 VARCHAR(MAX) NULL,\n";
-		q += u"value2 VARCHAR(MAX) NULL,\n";
+		q += u"value2 VARCHAR(MAX) NULL";
 	}
 
-	if (do_unique_key)
-		q += u"INDEX idx UNIQUE (";
-	else
-		q += u"PRIMARY KEY (";
-
-	bool first = true;
-
-	for (const auto& p : pk) {
-		if (!first)
-			q += u", ";
-
-		q += tds::escape(p.name);
+	if (!staged) {
+		q += u",\n";
 
-		if (p.desc)
-			q += u" DESC";
+		if (results_unique_key(pk))
+			q += u"INDEX idx UNIQUE ";
+		else
+			q += u"PRIMARY KEY ";
 
-		first = false;
+		q += results_key(pk, pk_only);
 	}
 
-	if (pk_only)
-		q += u")\n";
-	else
-		q += u", col)\n";
-
-	q += u");";
+	q += u"\n);";
 
 	{
 		tds::trans trans(tds);
@@ -196,12 +190,29 @@ static void create_results_table(tds::tds& tds, const vector<pk_col>& pk,
 		tds.run(tds::no_check{u"DROP TABLE IF EXISTS " + results_table});
 		tds.run(tds::no_check{q});
 
-		tds.run("EXEC sys.sp_addextendedproperty @name = N'microsoft_database_tools_support', @value = NULL, @level0type = 'SCHEMA', @level0name = 'Comparer', @level1type = 'TABLE', @level1name = ?", u"results" + to_u16string(num));
+		tds.run("EXEC sys.sp_addextendedproperty @name = N'microsoft_database_tools_support', @value = NULL, @level0type = 'SCHEMA', @level0name = 'Comparer', @level1type = 'TABLE', @level1name = ?", name);
 
 		trans.commit();
 	}
 }
 
+static void finish_staged_results(tds::tds& tds, const vector<pk_col>& pk, unsigned int num, bool pk_only) {
+	auto name = u"results" + to_u16string(num);
+	auto staging = u"Comparer." + name + u"_staging";
+
+	if (results_unique_key(pk))
+		tds.run(tds::no_check{u"CREATE UNIQUE INDEX idx ON " + staging + u" " + results_key(pk, pk_only)});
+	else
+		tds.run(tds::no_check{u"ALTER TABLE " + staging + u" ADD PRIMARY KEY " + results_key(pk, pk_only)});
+
+	tds::trans trans(tds);
+
+	tds.run(tds::no_check{u"DROP TABLE IF EXISTS Comparer." + name});
+	tds.run("EXEC sys.sp_rename @objname = ?, @newname = ?", staging, name);
+
+	trans.commit();
+}
+
 static u16string type_to_string(u16string_view name, int max_length, int precision, int scale) {
 	u16string ret{tds::escape(name)};
 
@@ -219,15 +230,106 @@ static u16string type_to_string(u16string_view name, int max_length, int precisi
 	return ret;
 }
 
-static void create_queries(tds::tds& tds, u16string_view tbl1, u16string_view tbl2,
-						   u16string& q1, u16string& q2, string& server1, string& server2,
-						   unsigned int& pk_columns, vector<pk_col>& pk,
-						   bool& pk_only) {
-	vector<u16string> cols;
+// The columns and key found for a table are kept in Comparer.metadata_cache, if comparer
+// --setup has created it, along with the table's modify_date, which changes whenever the
+// table or one of its indexes is altered. While that still matches, the catalog queries
+// can be skipped, which for a table on this server leaves just the one query.
+
+static bool load_cached_metadata(tds::tds& tds, tds::tds& t, u16string_view tbl, u16string_view prefix, bool remote,
+								 table_queries& tq) {
+	try {
+		optional<tds::query> sq2;
+
+		if (remote) {
+			tds::value modify_date;
+
+			{
+				tds::query sq(t, tds::no_check{uR"(SELECT objects.modify_date
+FROM )" + u16string(prefix) + uR"(sys.objects
+JOIN )" + u16string(prefix) + uR"(sys.schemas ON schemas.schema_id = objects.schema_id
+WHERE objects.name = PARSENAME(?, 1) AND
+schemas.name = PARSENAME(?, 2))"}, tbl, tbl);
+
+				if (!sq.fetch_row() || sq[0].is_null)
+					return false;
+
+				modify_date = sq[0];
+			}
+
+			sq2.emplace(tds, R"(SELECT name, key_type, is_descending, is_nullable
+FROM Comparer.metadata_cache
+WHERE table_name = ? AND modify_date = ?
+ORDER BY column_order)", tbl, modify_date);
+		} else {
+			sq2.emplace(tds, tds::no_check{uR"(SELECT name, key_type, is_descending, is_nullable
+FROM Comparer.metadata_cache
+WHERE table_name = ? AND modify_date = (SELECT modify_date FROM )" + u16string(prefix) + uR"(sys.objects WHERE object_id = OBJECT_ID(?))
+ORDER BY column_order)"}, tbl, tbl);
+		}
+
+		auto& sq = sq2.value();
+
+		while (sq.fetch_row()) {
+			auto name = (u16string)sq[0];
+
+			if (!sq[1].is_null) {
+				tq.pk.emplace_back(name, (u16string)sq[1], (unsigned int)sq[2] != 0, (unsigned int)sq[3] != 0);
+				tq.pk_columns++;
+			}
+
+			tq.cols.emplace_back(tds::escape(name));
+		}
+	} catch (...) {
+		// if there's no cache, or it can't be read, look everything up as usual
+
+		tq.cols.clear();
+		tq.pk.clear();
+		tq.pk_columns = 0;
+
+		return false;
+	}
+
+	return !tq.cols.empty();
+}
+
+static void save_cached_metadata(tds::tds& tds, u16string_view tbl, const tds::value& modify_date,
+								 const vector<u16string>& names, const table_queries& tq) {
+	try {
+		{
+			tds::query sq(tds, "SELECT OBJECT_ID('Comparer.metadata_cache')");
+
+			if (!sq.fetch_row() || sq[0].is_null)
+				return;
+		}
+
+		list<vector<tds::value>> rows;
+
+		for (size_t i = 0; i < names.size(); i++) {
+			if (i < tq.pk.size()) {
+				const auto& p = tq.pk[i];
+
+				rows.push_back({tbl, (int32_t)i, modify_date, names[i], p.type, (int32_t)p.desc, (int32_t)p.nullable});
+			} else
+				rows.push_back({tbl, (int32_t)i, modify_date, names[i], nullptr, (int32_t)0, (int32_t)0});
+		}
+
+		tds::trans trans(tds);
+
+		tds.run("DELETE FROM Comparer.metadata_cache WHERE table_name = ?", tbl);
+		tds.bcp(u"Comparer.metadata_cache", array{ u"table_name", u"column_order", u"modify_date", u"name", u"key_type", u"is_descending", u"is_nullable" }, rows);
+
+		trans.commit();
+	} catch (const exception& e) {
+		// the compare can go ahead without it
+		cerr << "Unable to cache metadata: " << e.what() << endl;
+	}
+}
+
+static void create_queries(tds::tds& tds, u16string_view tbl1, u16string_view tbl2, table_queries& tq) {
 	int64_t object_id;
 
-	pk_only = false;
-	pk_columns = 0;
+	tq.pk_only = false;
+	tq.pk_columns = 0;
 
 	auto onp = tds::parse_object_name(tbl1);
 
@@ -237,42 +339,47 @@ static void create_queries(tds::tds& tds, u16string_view tbl1, u16string_view tb
 		prefix = u16string(onp.db) + u".";
 
 	if (!onp.server.empty())
-		server1 = sanitize_identifier(tds::utf16_to_utf8(onp.server));
+		tq.server1 = sanitize_identifier(tds::utf16_to_utf8(onp.server));
 	else
-		server1 = db_server;
+		tq.server1 = db_server;
 
 	{
-		optional<tds::tds> tds2;
+		unique_ptr<tds::tds> tds2;
 
 		if (!onp.server.empty())
-			tds2.emplace(server1, db_username, db_password, DB_APP);
+			tds2 = connections.get(tq.server1, 0);
 
 		tds::tds& t = !onp.server.empty() ? *tds2 : tds;
 
-		{
-			optional<tds::query> sq2;
+		if (!load_cached_metadata(tds, t, tbl1, prefix, !onp.server.empty(), tq)) {
+			tds::value modify_date;
+			vector<u16string> names;
+
+			{
+				optional<tds::query> sq2;
 
-			if (!onp.server.empty()) {
-				sq2.emplace(t, tds::no_check{uR"(SELECT object_id
+				if (!onp.server.empty()) {
+					sq2.emplace(t, tds::no_check{uR"(SELECT object_id, modify_date
 FROM )" + prefix + uR"(sys.objects
 JOIN )" + prefix + uR"(sys.schemas ON schemas.schema_id = objects.schema_id
 WHERE objects.name = PARSENAME(?, 1) AND
 schemas.name = PARSENAME(?, 2))"}, tbl1, tbl1);
-			} else
-				sq2.emplace(t, tds::no_check{"SELECT OBJECT_ID(?)"}, tbl1);
+				} else
+					sq2.emplace(t, tds::no_check{u"SELECT object_id, modify_date FROM " + prefix + u"sys.objects WHERE object_id = OBJECT_ID(?)"}, tbl1);
 
-			auto& sq = sq2.value();
+				auto& sq = sq2.value();
 
-			if (!sq.fetch_row() || sq[0].is_null)
-				throw formatted_error("Could not get object ID for {}.", tds::utf16_to_utf8(tbl1));
+				if (!sq.fetch_row() || sq[0].is_null)
+					throw formatted_error("Could not get object ID for {}.", tds::utf16_to_utf8(tbl1));
 
-			object_id = (int64_t)sq[0];
-		}
+				object_id = (int64_t)sq[0];
+				modify_date = sq[1];
+			}
 
-		optional<int32_t> index_id;
+			optional<int32_t> index_id;
 
-		{
-			tds::query sq(t, tds::no_check{uR"(SELECT columns.name,
+			{
+				tds::query sq(t, tds::no_check{uR"(SELECT columns.name,
 	indexes.index_id,
 	CASE WHEN types.is_user_defined = 0 THEN UPPER(types.name) ELSE types.name END,
 	columns.max_length,
@@ -286,22 +393,23 @@ JOIN )" + prefix + uR"(sys.types ON types.user_type_id = columns.user_type_id
 WHERE index_columns.object_id = ? AND indexes.is_primary_key = 1
 ORDER BY index_columns.index_column_id)"}, object_id);
 
-			while (sq.fetch_row()) {
-				if (!index_id.has_value())
-					index_id = (int32_t)sq[1];
+				while (sq.fetch_row()) {
+					if (!index_id.has_value())
+						index_id = (int32_t)sq[1];
 
-				cols.emplace_back(tds::escape((u16string)sq[0]));
+					names.emplace_back((u16string)sq[0]);
+					tq.cols.emplace_back(tds::escape(names.back()));
 
-				auto type = type_to_string((u16string)sq[2], (int)sq[3], (int)sq[4], (int)sq[5]);
+					auto type = type_to_string((u16string)sq[2], (int)sq[3], (int)sq[4], (int)sq[5]);
 
-				pk.emplace_back((u16string)sq[0], type, (unsigned int)sq[6] != 0, false);
+					tq.pk.emplace_back((u16string)sq[0], type, (unsigned int)sq[6] != 0, false);
 
-				pk_columns++;
+					tq.pk_columns++;
+				}
 			}
-		}
 
-		if (!index_id.has_value()) { // if no primary key, look for unique key
-			tds::query sq(t, tds::no_check{uR"(SELECT columns.name,
+			if (!index_id.has_value()) { // if no primary key, look for unique key
+				tds::query sq(t, tds::no_check{uR"(SELECT columns.name,
 	indexes.index_id,
 	CASE WHEN types.is_user_defined = 0 THEN UPPER(types.name) ELSE types.name END,
 	columns.max_length,
@@ -321,798 +429,2242 @@ WHERE indexes.object_id = ? AND indexes.index_id = (
 )
 ORDER BY index_columns.index_column_id)"}, object_id, object_id);
 
-			while (sq.fetch_row()) {
-				if (!index_id.has_value())
-					index_id = (int32_t)sq[1];
+				while (sq.fetch_row()) {
+					if (!index_id.has_value())
+						index_id = (int32_t)sq[1];
 
-				cols.emplace_back(tds::escape((u16string)sq[0]));
+					names.emplace_back((u16string)sq[0]);
+					tq.cols.emplace_back(tds::escape(names.back()));
 
-				auto type = type_to_string((u16string)sq[2], (int)sq[3], (int)sq[4], (int)sq[5]);
+					auto type = type_to_string((u16string)sq[2], (int)sq[3], (int)sq[4], (int)sq[5]);
 
-				pk.emplace_back((u16string)sq[0], type, (unsigned int)sq[6] != 0,
-								(unsigned int)sq[7] != 0);
+					tq.pk.emplace_back((u16string)sq[0], type, (unsigned int)sq[6] != 0,
+									(unsigned int)sq[7] != 0);
 
-				pk_columns++;
+					tq.pk_columns++;
+				}
 			}
-		}
 
-		{
-			tds::query sq(t, tds::no_check{uR"(SELECT columns.name
+			{
+				tds::query sq(t, tds::no_check{uR"(SELECT columns.name
 FROM )" + prefix + uR"(sys.columns
 LEFT JOIN )" + prefix + uR"(sys.index_columns ON index_columns.object_id = columns.object_id AND index_columns.index_id = ? AND index_columns.column_id = columns.column_id
 WHERE columns.object_id = ? AND index_columns.column_id IS NULL
 ORDER BY columns.column_id)"}, index_id, object_id);
 
-			while (sq.fetch_row()) {
-				auto s = (u16string)sq[0];
+				while (sq.fetch_row()) {
+					auto s = (u16string)sq[0];
 
-				if (s == u"Data Load Date" || s == u"data_load_date" || s == u"Snapshot Created") // FIXME - option for this?
-					continue;
+					if (s == u"Data Load Date" || s == u"data_load_date" || s == u"Snapshot Created") // FIXME - option for this?
+						continue;
 
-				cols.emplace_back(tds::escape(s));
+					names.emplace_back(s);
+					tq.cols.emplace_back(tds::escape(s));
+				}
 			}
+
+			save_cached_metadata(tds, tbl1, modify_date, names, tq);
 		}
+
+		connections.put(tq.server1, 0, move(tds2));
 	}
 
-	pk_only = pk_columns == cols.size();
+	tq.pk_only = tq.pk_columns == tq.cols.size();
 
-	if (cols.empty())
+	if (tq.cols.empty())
 		throw formatted_error("No columns returned for {}.", tds::utf16_to_utf8(tbl1));
 
-	for (const auto& col : cols) {
-		if (q1.empty())
-			q1 = u"SELECT ";
-		else
-			q1 += u", ";
-
-		q1 += col;
-
-		if (q2.empty())
-			q2 = u"SELECT ";
-		else
-			q2 += u", ";
-
-		q2 += col;
-	}
-
-	q1 += u" FROM ";
-	q1 += tbl1;
-	q1 += u" ORDER BY ";
-
-	q2 += u" FROM ";
+	tq.from1 = tbl1;
 
 	onp = tds::parse_object_name(tbl2);
 
 	if (!onp.server.empty()) {
-		server2 = sanitize_identifier(tds::utf16_to_utf8(onp.server));
+		tq.server2 = sanitize_identifier(tds::utf16_to_utf8(onp.server));
 
 		if (!onp.db.empty()) {
-			q2 += onp.db;
-			q2 += u".";
+			tq.from2 += onp.db;
+			tq.from2 += u".";
 		}
 
 		if (!onp.schema.empty()) {
-			q2 += onp.schema;
-			q2 += u".";
+			tq.from2 += onp.schema;
+			tq.from2 += u".";
 		}
 
-		q2 += onp.name;
+		tq.from2 += onp.name;
 	} else {
-		server2 = db_server;
-		q2 += tbl2;
+		tq.server2 = db_server;
+		tq.from2 = tbl2;
 	}
 
-	q2 += u" ORDER BY ";
+	u16string sel;
 
-	for (unsigned int i = 0; i < ((pk_columns == 0) ? cols.size() : pk_columns); i++) {
-		if (i != 0) {
-			q1 += u", ";
-			q2 += u", ";
-		}
+	for (const auto& col : tq.cols) {
+		if (sel.empty())
+			sel = u"SELECT ";
+		else
+			sel += u", ";
 
-		q1 += cols[i];
-		q2 += cols[i];
+		sel += col;
 	}
-}
 
-static weak_ordering compare_cols(const vector<tds::column>& row1, const vector<tds::column>& row2, unsigned int columns) {
-	for (unsigned int i = 0; i < columns; i++) {
-		if (row1[i].is_null || row2[i].is_null) {
-			if (row1[i].is_null && row2[i].is_null)
-				continue;
-			else if (row1[i].is_null)
-				return weak_ordering::less;
-			else
-				return weak_ordering::greater;
-		}
+	tq.q1 = sel + u" FROM " + tq.from1;
+	tq.q2 = sel + u" FROM " + tq.from2;
 
-		auto ret = row1[i] <=> row2[i];
+	tq.order_by = u" ORDER BY ";
 
-		if (ret == partial_ordering::unordered)
-			throw runtime_error("Unexpected partial_ordering::unordered while comparing primary keys.");
+	for (unsigned int i = 0; i < ((tq.pk_columns == 0) ? tq.cols.size() : tq.pk_columns); i++) {
+		if (i != 0)
+			tq.order_by += u", ";
 
-		if (ret == partial_ordering::less)
-			return weak_ordering::less;
-		else if (ret == partial_ordering::greater)
-			return weak_ordering::greater;
+		tq.order_by += tq.cols[i];
 	}
-
-	return weak_ordering::equivalent;
 }
 
-static string make_pk_string(const vector<tds::column>& row, unsigned int pk_columns) {
-	string ret;
+static u16string value_literal(const tds::value& v, u16string_view type) {
+	static constexpr char16_t hex[] = u"0123456789ABCDEF";
 
-	for (unsigned int i = 0; i < pk_columns; i++) {
-		if (i != 0)
-			ret += ",";
+	if (v.is_null)
+		return u"NULL";
+
+	switch (v.type) {
+		case tds::sql_type::BINARY:
+		case tds::sql_type::VARBINARY:
+		case tds::sql_type::BIGBINARY:
+		case tds::sql_type::BIGVARBINARY:
+		case tds::sql_type::IMAGE: {
+			u16string ret = u"0x";
+
+			ret.reserve(2 + (v.val.size() * 2));
+
+			for (auto c : v.val) {
+				ret += hex[c >> 4];
+				ret += hex[c & 0xf];
+			}
+
+			return ret;
+		}
 
-		ret += (string)row[i];
+		default:
+			break;
 	}
 
+	u16string ret = u"CAST(N'";
+
+	for (auto c : (u16string)v) {
+		if (c == u'\'')
+			ret += u"''";
+		else
+			ret += c;
+	}
+
+	ret += u"' AS ";
+	ret += type;
+	ret += u")";
+
 	return ret;
 }
 
-static string pseudo_pk(unsigned int& rownum) {
-	auto s = format("{}", rownum);
+// Returns up to ranges - 1 literals which split the first key column into roughly equal
+// ranges. If where is given, the keys matching it are divided up exactly; otherwise we
+// try to get away without reading the whole table.
 
-	rownum++;
+static vector<u16string> get_range_bounds(tds::tds& tds, u16string_view tbl, const pk_col& k,
+										  unsigned int ranges, u16string_view where = {}) {
+	vector<tds::value> bounds;
+	auto col = tds::escape(k.name);
+	auto onp = tds::parse_object_name(tbl);
 
-	return s;
-}
+	if (where.empty() && onp.server.empty() && onp.db.empty()) {
+		// The statistics histogram on the key gives us row counts for nothing. Each step
+		// covers the rows up to and including range_high_key, so we split where the
+		// running total passes each multiple of total / ranges.
+
+		try {
+			vector<pair<tds::value, double>> steps;
+			double total = 0.0;
+
+			{
+				tds::query sq(tds, tds::no_check{uR"(WITH s AS (
+	SELECT TOP (1) stats_columns.object_id, stats_columns.stats_id
+	FROM sys.stats_columns
+	WHERE stats_columns.object_id = OBJECT_ID(?) AND
+	stats_columns.stats_column_id = 1 AND
+	stats_columns.column_id = COLUMNPROPERTY(stats_columns.object_id, ?, 'ColumnId')
+	ORDER BY stats_columns.stats_id
+)
+SELECT CAST(h.range_high_key AS )" + k.type + uR"(), h.equal_rows + h.range_rows
+FROM s
+CROSS APPLY sys.dm_db_stats_histogram(s.object_id, s.stats_id) h
+ORDER BY h.step_number)"}, tbl, k.name);
 
-static bool value_cmp(const tds::value& v1, const tds::value& v2) {
-	if (v1.type != tds::sql_type::FLOAT && v1.type != tds::sql_type::REAL && v1.type != tds::sql_type::FLTN)
-		return v1 == v2;
+				while (sq.fetch_row()) {
+					if (sq[0].is_null)
+						continue;
 
-	// for FLOATs, allow some leeway on values
+					steps.emplace_back(sq[0], (double)sq[1]);
+					total += steps.back().second;
+				}
+			}
 
-	// FIXME - for REALs, use float rather than double
+			double running = 0.0;
 
-	auto d1 = (double)v1;
-	auto d2 = (double)v2;
+			for (const auto& st : steps) {
+				running += st.second;
+
+				if (bounds.size() == ranges - 1)
+					break;
 
-	if (d1 > -1.0e-10 && d1 < 1.0e-10)
-		d1 = 0.0;
+				if (running >= total * (double)(bounds.size() + 1) / (double)ranges && (bounds.empty() || !(bounds.back() == st.first)))
+					bounds.emplace_back(st.first);
+			}
+		} catch (...) {
+			// sys.dm_db_stats_histogram needs SQL Server 2016 SP1 CU2
+			bounds.clear();
+		}
+	}
 
-	if (d2 > -1.0e-10 && d2 < 1.0e-10)
-		d2 = 0.0;
+	if (bounds.empty()) {
+		// otherwise, take a 1% sample of the keys and divide that up
 
-#ifdef __GNUC__
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wstrict-aliasing"
-#endif
+		try {
+			tds::query sq(tds, tds::no_check{u"SELECT MIN(" + col + u") FROM (SELECT " + col + u", NTILE(" +
+											 to_u16string(ranges) + u") OVER (ORDER BY " + col + u") AS tile FROM " +
+											 u16string(tbl) + (where.empty() ? u" TABLESAMPLE SYSTEM (1 PERCENT) WHERE " : u" WHERE (" + u16string(where) + u") AND ") +
+											 col + u" IS NOT NULL) sample GROUP BY tile HAVING tile > 1 ORDER BY 1"});
 
-	auto i1 = *reinterpret_cast<int64_t*>(&d1);
-	auto i2 = *reinterpret_cast<int64_t*>(&d2);
+			while (sq.fetch_row()) {
+				if (bounds.empty() || !(bounds.back() == sq[0]))
+					bounds.emplace_back(sq[0]);
+			}
+		} catch (...) {
+			// TABLESAMPLE doesn't work on views - fall back to a single range
+			bounds.clear();
+		}
+	}
 
-#ifdef __GNUC__
-#pragma GCC diagnostic pop
-#endif
+	vector<u16string> ret;
 
-	auto diff = i1 - i2;
+	ret.reserve(bounds.size());
 
-	// this should be about 10 s.f.
+	for (const auto& b : bounds) {
+		ret.emplace_back(value_literal(b, k.type));
+	}
 
-	return diff < 262144 && diff >= -262144;
+	return ret;
 }
 
-void bcp_thread::run(stop_token stop) noexcept {
-	static const unsigned int MAX_BUF_ROWS = 100000;
+// Returns the predicate for lower <= key < upper, where an empty bound means unbounded.
 
-	try {
-		tds::tds tds(db_server, db_username, db_password, DB_APP);
+static u16string range_predicate(const pk_col& k, u16string_view lower, u16string_view upper) {
+	auto col = tds::escape(k.name);
+	u16string p;
 
-		do {
-			decltype(res) local_res;
-			bool wait;
-			vector<u16string> columns;
+	if (!lower.empty())
+		p = col + u" >= " + u16string(lower);
 
-			if (!pk.empty()) {
-				columns.reserve(pk.size());
+	if (!upper.empty()) {
+		if (!p.empty())
+			p += u" AND ";
 
-				for (const auto& p : pk) {
-					columns.emplace_back(p);
-				}
+		// NULLs sort first, so they go in whichever range has no lower bound
 
-				columns.emplace_back(u"change");
+		if (lower.empty() && k.nullable)
+			p += u"(" + col + u" IS NULL OR " + col + u" < " + u16string(upper) + u")";
+		else
+			p += col + u" < " + u16string(upper);
+	}
 
-				if (table_name.empty() || !pk_only) {
-					columns.emplace_back(u"col");
-					columns.emplace_back(u"value1");
-					columns.emplace_back(u"value2");
-					columns.emplace_back(u"col_name");
-				}
-			}
+	return p;
+}
 
-			{
-				unique_lock ul(lock);
+static vector<u16string> get_range_predicates(tds::tds& tds, u16string_view tbl, const pk_col& k,
+											  unsigned int ranges) {
+	auto bounds = get_range_bounds(tds, tbl, k, ranges);
+	vector<u16string> preds;
 
-				cv.wait(ul, stop, [&]{ return !res.empty(); });
+	for (size_t i = 0; i <= bounds.size(); i++) {
+		preds.emplace_back(range_predicate(k, i > 0 ? bounds[i - 1] : u"", i < bounds.size() ? bounds[i] : u""));
+	}
 
-				local_res.splice(local_res.end(), res);
+	return preds;
+}
 
-				// if buffer full, pause other threads by keeping hold of lock
-				wait = res.size() + local_res.size() >= MAX_BUF_ROWS;
-			}
+// The first 16 bytes of the hash are summed as four 32-bit words, which can't overflow a
+// BIGINT however many rows there are.
 
-			if (local_res.empty() && stop.stop_requested())
-				break;
+static constexpr unsigned int CHECKSUM_WORDS = 4;
 
-			optional<lock_guard<mutex>> lg;
+struct range_checksum {
+	int64_t rows = 0;
+	array<int64_t, CHECKSUM_WORDS> sums{};
 
-			if (wait)
-				lg.emplace(lock);
+	bool operator==(const range_checksum&) const = default;
+};
 
-			while (!local_res.empty()) {
-				decltype(local_res) res2;
+// Returns a SHA2_256 over the columns from first_col onwards. Each value is prefixed by
+// its length, so that NULLs and empty values, or adjacent values, can't be confused with
+// each other.
 
-				if (local_res.size() <= 10000)
-					res2.swap(local_res);
-				else {
-					for (unsigned int i = 0; i < 10000; i++) {
-						res2.push_back(move(local_res.front()));
-						local_res.pop_front();
-					}
-				}
+static u16string hash_expression(const table_queries& tq, size_t first_col, u16string_view alias = u"") {
+	u16string parts;
 
-				if (table_name.empty())
-					tds.bcp(u"Comparer.results", array{ u"query", u"primary_key", u"change", u"col", u"value1", u"value2", u"col_name" }, res2);
-				else
-					tds.bcp(table_name, columns, res2);
-			}
-		} while (true);
-	} catch (...) {
-		exc = current_exception();
+	for (size_t i = first_col; i < tq.cols.size(); i++) {
+		auto col = u16string(alias) + tq.cols[i];
+
+		if (!parts.empty())
+			parts += u" + ";
+
+		parts += u"ISNULL(0x01 + CAST(DATALENGTH(" + col + u") AS BINARY(4)) + CAST(" + col + u" AS VARBINARY(MAX)), 0x00)";
 	}
-}
 
-static void repartition_results_table(tds::tds& tds, unsigned int num) {
-	unsigned int func_num, next_num;
-	bool part_found;
+	return u"HASHBYTES('SHA2_256', " + parts + u")";
+}
 
-	{
-		tds::query sq(tds, "SELECT function_id FROM sys.partition_functions WHERE name = 'comparer_part_func'");
+static vector<range_checksum> get_bucket_checksums(tds::tds& tds, u16string_view tbl, const pk_col& k,
+												   u16string_view expr, u16string_view where,
+												   const vector<u16string>& bounds) {
+	auto col = tds::escape(k.name);
+	u16string bucket = u"CASE";
 
-		if (!sq.fetch_row()) // not partitioned
-			return;
+	if (k.nullable)
+		bucket += u" WHEN " + col + u" IS NULL THEN 0";
 
-		func_num = (unsigned int)sq[0];
+	for (size_t i = 0; i < bounds.size(); i++) {
+		bucket += u" WHEN " + col + u" < " + bounds[i] + u" THEN " + to_u16string(i);
 	}
 
-	{
-		tds::query sq(tds, "SELECT * FROM sys.partition_range_values WHERE function_id = ? AND value = ?", func_num, num);
+	bucket += u" ELSE " + to_u16string(bounds.size()) + u" END";
 
-		part_found = sq.fetch_row();
-	}
+	vector<range_checksum> ret(bounds.size() + 1);
 
-	if (!part_found) {
-		tds.run("ALTER PARTITION SCHEME comparer_part_scheme NEXT USED [PRIMARY]");
-		tds.run("ALTER PARTITION FUNCTION comparer_part_func() SPLIT RANGE(?)", num);
+	u16string sums;
+
+	for (unsigned int i = 0; i < CHECKSUM_WORDS; i++) {
+		sums += u", SUM(CAST(CAST(SUBSTRING(chk, " + to_u16string((i * 4) + 1) + u", 4) AS INT) AS BIGINT))";
 	}
 
-	{
-		// parameterization slows this down
-		tds::query sq(tds, tds::no_check{"SELECT MIN(query) FROM Comparer.results WHERE query > " + to_string(num)});
+	tds::query sq(tds, tds::no_check{u"SELECT bucket, COUNT_BIG(*)" + sums + u" FROM (SELECT " +
+									 bucket + u" AS bucket, " + u16string(expr) + u" AS chk FROM " + u16string(tbl) +
+									 (where.empty() ? u"" : u" WHERE " + u16string(where)) + u") buckets GROUP BY bucket"});
 
-		if (!sq.fetch_row())
-			return;
+	while (sq.fetch_row()) {
+		auto& c = ret[(size_t)(int64_t)sq[0]];
 
-		if (sq[0].is_null)
+		c.rows = (int64_t)sq[1];
+
+		for (uint16_t i = 0; i < CHECKSUM_WORDS; i++) {
+			c.sums[i] = sq[i + 2].is_null ? 0 : (int64_t)sq[i + 2];
+		}
+	}
+
+	return ret;
+}
+
+// Compares aggregate checksums of key ranges on both servers, dividing any that differ
+// until they're small enough to be worth streaming. Returns the predicates for the
+// ranges that still need comparing - none if the tables match, or a single empty
+// predicate if the whole table does. The rows in matching ranges are added to stats.
+
+static vector<u16string> checksum_ranges(tds::tds& tds1, tds::tds& tds2, const table_queries& tq,
+										 compare_stats& stats) {
+	static const unsigned int FANOUT = 16;
+	static const int64_t LEAF_ROWS = 10000;
+	static const unsigned int MAX_DEPTH = 8;
+	static const size_t MAX_LEAVES = 512;
+
+	struct segment {
+		u16string lower, upper;
+		unsigned int depth;
+	};
+
+	const auto& k = tq.pk.front();
+	auto expr = hash_expression(tq, 0);
+	vector<segment> todo, leaves;
+	unsigned int rows1 = 0, rows2 = 0;
+
+	todo.emplace_back(u"", u"", 0);
+
+	// depth-first, so that we don't hold on to more pending ranges than we need to
+
+	while (!todo.empty()) {
+		auto seg = move(todo.back());
+
+		todo.pop_back();
+
+		auto where = range_predicate(k, seg.lower, seg.upper);
+		auto bounds = get_range_bounds(tds1, tq.from1, k, FANOUT, where);
+
+		// a bound equal to the lower limit would give us the same range back again
+		if (!bounds.empty() && bounds.front() == seg.lower)
+			bounds.erase(bounds.begin());
+
+		vector<range_checksum> sums1, sums2;
+		exception_ptr ex;
+
+		{
+			jthread t([&]() noexcept {
+				try {
+					sums2 = get_bucket_checksums(tds2, tq.from2, k, expr, where, bounds);
+				} catch (...) {
+					ex = current_exception();
+				}
+			});
+
+			sums1 = get_bucket_checksums(tds1, tq.from1, k, expr, where, bounds);
+		}
+
+		if (ex)
+			rethrow_exception(ex);
+
+		vector<segment> children;
+
+		for (size_t i = 0; i <= bounds.size(); i++) {
+			const auto& lower = i == 0 ? seg.lower : bounds[i - 1];
+			const auto& upper = i == bounds.size() ? seg.upper : bounds[i];
+
+			if (sums1[i] == sums2[i]) {
+				// counted as we go, so that the progress in the log moves during this pass
+
+				rows1 += (unsigned int)sums1[i].rows;
+				rows2 += (unsigned int)sums2[i].rows;
+				stats.rows1 += (unsigned int)sums1[i].rows;
+				stats.rows2 += (unsigned int)sums2[i].rows;
+				continue;
+			}
+
+			if (bounds.empty() || seg.depth + 1 >= MAX_DEPTH || max(sums1[i].rows, sums2[i].rows) <= LEAF_ROWS) {
+				// merge with the previous leaf if they're contiguous
+				if (!leaves.empty() && !lower.empty() && leaves.back().upper == lower)
+					leaves.back().upper = upper;
+				else
+					leaves.emplace_back(lower, upper, seg.depth + 1);
+			} else
+				children.emplace_back(lower, upper, seg.depth + 1);
+		}
+
+		todo.insert(todo.end(), make_move_iterator(children.rbegin()), make_move_iterator(children.rend()));
+
+		if (leaves.size() > MAX_LEAVES) { // too many differences for this to help
+			stats.rows1 -= rows1;
+			stats.rows2 -= rows2;
+
+			return { u"" };
+		}
+	}
+
+	vector<u16string> preds;
+
+	for (const auto& l : leaves) {
+		preds.emplace_back(range_predicate(k, l.lower, l.upper));
+	}
+
+	return preds;
+}
+
+// Each writer gets its own connection, which is kept alive by the function it returns.
+
+function<void(diff_arena&)> bcp_thread::writer() {
+	struct writer_state {
+		~writer_state() {
+			if (!broken)
+				connections.put(db_server, 0, move(conn));
+		}
+
+		unique_ptr<tds::tds> conn = connections.get(db_server, 0);
+		vector<u16string> columns;
+		vector<vector<tds::value>> rows;
+		bool broken = false;
+	};
+
+	auto st = make_shared<writer_state>();
+	bool legacy = table_name.empty();
+
+	if (!pk.empty()) {
+		auto& columns = st->columns;
+
+		columns.reserve(pk.size());
+
+		for (const auto& p : pk) {
+			columns.emplace_back(p);
+		}
+
+		columns.emplace_back(u"change");
+
+		if (legacy || !pk_only) {
+			columns.emplace_back(u"col");
+			columns.emplace_back(u"value1");
+			columns.emplace_back(u"value2");
+			columns.emplace_back(u"col_name");
+		}
+	}
+
+	return [this, st, legacy](diff_arena& a) {
+		auto& rows = st->rows;
+
+		for (size_t start = 0; start < a.records.size(); start += 10000) {
+			rows.resize(min<size_t>(a.records.size() - start, 10000));
+
+			for (size_t i = 0; i < rows.size(); i++) {
+				diff_row(rows[i], a, a.records[start + i], legacy);
+			}
+
+			auto write_start = chrono::steady_clock::now();
+
+			if (bcp_slots)
+				bcp_slots->acquire();
+
+			try {
+				if (legacy)
+					st->conn->bcp(legacy_table, array{ u"query", u"primary_key", u"change", u"col", u"value1", u"value2", u"col_name" }, rows);
+				else
+					st->conn->bcp(table_name, st->columns, rows);
+			} catch (...) {
+				if (bcp_slots)
+					bcp_slots->release();
+
+				st->broken = true;
+
+				throw;
+			}
+
+			if (bcp_slots)
+				bcp_slots->release();
+
+			write_ns += elapsed_ns(write_start);
+			rows_written += rows.size();
+		}
+	};
+}
+
+static void repartition_results_table(tds::tds& tds, unsigned int num) {
+	unsigned int func_num, next_num;
+	bool part_found;
+
+	{
+		tds::query sq(tds, "SELECT function_id FROM sys.partition_functions WHERE name = 'comparer_part_func'");
+
+		if (!sq.fetch_row()) // not partitioned
+			return;
+
+		func_num = (unsigned int)sq[0];
+	}
+
+	{
+		tds::query sq(tds, "SELECT * FROM sys.partition_range_values WHERE function_id = ? AND value = ?", func_num, num);
+
+		part_found = sq.fetch_row();
+	}
+
+	if (!part_found) {
+		tds.run("ALTER PARTITION SCHEME comparer_part_scheme NEXT USED [PRIMARY]");
+		tds.run("ALTER PARTITION FUNCTION comparer_part_func() SPLIT RANGE(?)", num);
+	}
+
+	{
+		// parameterization slows this down
+		tds::query sq(tds, tds::no_check{"SELECT MIN(query) FROM Comparer.results WHERE query > " + to_string(num)});
+
+		if (!sq.fetch_row())
+			return;
+
+		if (sq[0].is_null)
 			return;
 
-		next_num = (unsigned int)sq[0];
-	}
+		next_num = (unsigned int)sq[0];
+	}
+
+	{
+		tds::query sq(tds, "SELECT * FROM sys.partition_range_values WHERE function_id = ? AND value = ?", func_num, next_num);
+
+		part_found = sq.fetch_row();
+	}
+
+	if (part_found)
+		return;
+
+	tds.run("ALTER PARTITION SCHEME comparer_part_scheme NEXT USED [PRIMARY]");
+	tds.run("ALTER PARTITION FUNCTION comparer_part_func() SPLIT RANGE(?)", next_num);
+}
+
+// Returns the partition of Comparer.results which holds a query's results, if the
+// table is partitioned.
+
+static optional<int32_t> results_partition(tds::tds& tds, unsigned int num) {
+	{
+		tds::query sq(tds, "SELECT function_id FROM sys.partition_functions WHERE name = 'comparer_part_func'");
+
+		if (!sq.fetch_row())
+			return nullopt;
+	}
+
+	tds::query sq(tds, "SELECT $PARTITION.comparer_part_func(?)", num);
+
+	if (!sq.fetch_row())
+		throw runtime_error("Unable to get partition number.");
+
+	return (int32_t)sq[0];
+}
+
+static void delete_old_results(tds::tds& tds, unsigned int num) {
+	auto part_num = results_partition(tds, num);
+
+	if (part_num.has_value()) {
+		tds.run("TRUNCATE TABLE Comparer.results WITH (PARTITIONS(?))", *part_num);
+
+		return;
+	}
+
+	tds.run(R"(
+WHILE 1 = 1
+BEGIN
+	DELETE TOP (100000)
+	FROM Comparer.results
+	WHERE query=?;
+
+	IF @@ROWCOUNT < 100000
+		BREAK;
+END
+)", num);
+}
+
+// Returns the statements which will give a staging table the same indexes as
+// Comparer.results, which it needs to be switched into it, or nothing if there are
+// any that this doesn't know how to copy.
+
+static optional<vector<u16string>> results_index_statements(tds::tds& tds, u16string_view staging) {
+	struct index {
+		u16string name;
+		unsigned int type;
+		bool unique, primary_key, filtered;
+		u16string keys, includes;
+	};
+
+	vector<index> indexes;
+	vector<u16string> ret;
+
+	{
+		tds::query sq(tds, R"(SELECT i.index_id, i.name, i.type, i.is_unique, i.is_primary_key, i.has_filter, c.name, ic.is_descending_key, ic.is_included_column
+FROM sys.indexes i
+JOIN sys.index_columns ic ON ic.object_id = i.object_id AND ic.index_id = i.index_id
+JOIN sys.columns c ON c.object_id = ic.object_id AND c.column_id = ic.column_id
+WHERE i.object_id = OBJECT_ID('Comparer.results') AND i.index_id > 0 AND (ic.key_ordinal > 0 OR ic.is_included_column = 1)
+ORDER BY i.index_id, ic.is_included_column, ic.key_ordinal, ic.index_column_id)");
+		int32_t last_id = -1;
+
+		while (sq.fetch_row()) {
+			if ((int32_t)sq[0] != last_id) {
+				indexes.push_back({(u16string)sq[1], (unsigned int)sq[2], (unsigned int)sq[3] != 0,
+								   (unsigned int)sq[4] != 0, (unsigned int)sq[5] != 0, u"", u""});
+				last_id = (int32_t)sq[0];
+			}
+
+			auto& ix = indexes.back();
+			auto& list = (unsigned int)sq[8] != 0 ? ix.includes : ix.keys;
+
+			if (!list.empty())
+				list += u", ";
+
+			list += tds::escape((u16string)sq[6]);
+
+			if ((unsigned int)sq[7] != 0)
+				list += u" DESC";
+		}
+	}
+
+	for (const auto& ix : indexes) {
+		if ((ix.type != 1 && ix.type != 2) || ix.filtered) // only plain rowstore indexes
+			return nullopt;
+
+		auto kind = ix.type == 1 ? u"CLUSTERED" : u"NONCLUSTERED";
+
+		if (ix.primary_key)
+			ret.emplace_back(u"ALTER TABLE " + u16string(staging) + u" ADD PRIMARY KEY " + kind + u" (" + ix.keys + u")");
+		else {
+			auto q = u"CREATE " + u16string(ix.unique ? u"UNIQUE " : u"") + kind + u" INDEX " + tds::escape(ix.name) +
+					 u" ON " + u16string(staging) + u" (" + ix.keys + u")";
+
+			if (!ix.includes.empty())
+				q += u" INCLUDE (" + ix.includes + u")";
+
+			ret.emplace_back(q);
+		}
+	}
+
+	return ret;
+}
+
+// Indexes a loaded staging table, and swaps it in for the query's partition of
+// Comparer.results.
+
+static void switch_in_results(tds::tds& tds, unsigned int num, int32_t part_num, u16string_view staging,
+							  const vector<u16string>& indexes) {
+	for (const auto& q : indexes) {
+		tds.run(tds::no_check{q});
+	}
+
+	// SWITCH needs to be able to tell that everything belongs in the partition
+
+	tds.run(tds::no_check{u"ALTER TABLE " + u16string(staging) + u" ADD CHECK (query IS NOT NULL AND query = " + to_u16string(num) + u")"});
+
+	tds::trans trans(tds);
+
+	tds.run("TRUNCATE TABLE Comparer.results WITH (PARTITIONS(?))", part_num);
+	tds.run(tds::no_check{u"ALTER TABLE " + u16string(staging) + u" SWITCH TO Comparer.results PARTITION " + to_u16string(part_num)});
+	tds.run(tds::no_check{u"DROP TABLE " + u16string(staging)});
+
+	trans.commit();
+}
+
+static u16string row_hash_expression(const table_queries& tq, u16string_view alias = u"") {
+	if (tq.pk_columns == tq.cols.size())
+		return u"CAST(0x00 AS BINARY(8))";
+
+	return u"CAST(" + hash_expression(tq, tq.pk_columns, alias) + u" AS BINARY(8))";
+}
+
+static u16string key_join(const vector<pk_col>& pk, u16string_view a, u16string_view b) {
+	u16string ret;
+
+	for (const auto& p : pk) {
+		auto n = tds::escape(p.name);
+		auto c1 = u16string(a) + u"." + n;
+		auto c2 = u16string(b) + u"." + n;
+
+		if (!ret.empty())
+			ret += u" AND ";
+
+		if (p.nullable)
+			ret += u"(" + c1 + u" = " + c2 + u" OR (" + c1 + u" IS NULL AND " + c2 + u" IS NULL))";
+		else
+			ret += c1 + u" = " + c2;
+	}
+
+	return ret;
+}
+
+// Character columns are given the database's collation rather than tempdb's, so that a
+// temporary table can be joined to the results and hash tables.
+
+static void create_key_table(tds::tds& tds, u16string_view name, const vector<pk_col>& pk, bool hashes) {
+	u16string q = u"CREATE TABLE " + u16string(name) + u" (\n";
+	bool first = true;
+
+	for (const auto& p : pk) {
+		if (!first)
+			q += u",\n";
+
+		q += tds::escape(p.name) + u" " + p.type;
+
+		if (p.type.starts_with(u"CHAR") || p.type.starts_with(u"VARCHAR") ||
+			p.type.starts_with(u"NCHAR") || p.type.starts_with(u"NVARCHAR")) {
+			q += u" COLLATE DATABASE_DEFAULT";
+		}
+
+		q += p.nullable ? u" NULL" : u" NOT NULL";
+
+		first = false;
+	}
+
+	if (hashes) {
+		q += u",\nhash1 BINARY(8) NULL";
+		q += u",\nhash2 BINARY(8) NULL";
+	}
+
+	q += u"\n);";
+
+	tds.run(tds::no_check{q});
+}
+
+static u16string hash_table_name(unsigned int num) {
+	return u"Comparer.hashes" + to_u16string(num);
+}
+
+static void create_hash_table(tds::tds& tds, unsigned int num, const vector<pk_col>& pk) {
+	auto name = hash_table_name(num);
+	u16string idx;
+	bool do_unique_key = false;
+
+	for (const auto& p : pk) {
+		if (!idx.empty())
+			idx += u", ";
+
+		idx += tds::escape(p.name);
+
+		if (p.nullable)
+			do_unique_key = true;
+	}
+
+	tds::trans trans(tds);
+
+	tds.run(tds::no_check{u"DROP TABLE IF EXISTS " + name});
+
+	create_key_table(tds, name, pk, true);
+
+	if (do_unique_key)
+		tds.run(tds::no_check{u"CREATE UNIQUE CLUSTERED INDEX idx ON " + name + u" (" + idx + u")"});
+	else
+		tds.run(tds::no_check{u"ALTER TABLE " + name + u" ADD PRIMARY KEY (" + idx + u")"});
+
+	tds.run("EXEC sys.sp_addextendedproperty @name = N'microsoft_database_tools_support', @value = NULL, @level0type = 'SCHEMA', @level0name = 'Comparer', @level1type = 'TABLE', @level1name = ?", u"hashes" + to_u16string(num));
+
+	trans.commit();
+}
+
+// The hash index from the last run can only be used if the results it describes are
+// still there, and it was built with the same key.
+
+static bool hash_index_usable(tds::tds& tds, unsigned int num, const vector<pk_col>& pk) {
+	vector<u16string> names;
+
+	{
+		tds::query sq(tds, "SELECT OBJECT_ID(?)", u"Comparer.results" + to_u16string(num));
+
+		if (!sq.fetch_row() || sq[0].is_null)
+			return false;
+	}
+
+	{
+		tds::query sq(tds, "SELECT name FROM sys.columns WHERE object_id = OBJECT_ID(?) ORDER BY column_id", hash_table_name(num));
+
+		while (sq.fetch_row()) {
+			names.emplace_back((u16string)sq[0]);
+		}
+	}
+
+	if (names.size() != pk.size() + 2)
+		return false;
+
+	for (size_t i = 0; i < pk.size(); i++) {
+		if (names[i] != pk[i].name)
+			return false;
+	}
+
+	return true;
+}
+
+struct hash_pass {
+	unsigned int rows1 = 0, rows2 = 0;
+};
+
+static optional<span<const uint8_t>> hash_value(const batch_cursor& s, uint16_t col) {
+	const auto& c = s.batch().columns[col];
+
+	if (c.is_null(s.row))
+		return nullopt;
+
+	return c.value(s.row);
+}
+
+static bool hashes_equal(const optional<span<const uint8_t>>& h1, const optional<span<const uint8_t>>& h2) {
+	if (!h1.has_value() || !h2.has_value())
+		return h1.has_value() == h2.has_value();
+
+	return h1->size() == h2->size() && !memcmp(h1->data(), h2->data(), h1->size());
+}
+
+// Merges the key and hash streams from both sides, and optionally the hash index from
+// the last run. Keys whose hashes differ between the sides are passed to refetch,
+// unless neither hash has changed since the last run, in which case the results we
+// already have for them still stand. If changes is given, every key whose hashes
+// differ from the index is passed to it, with its new hashes.
+
+static void compare_hashes(sql_thread& t1, sql_thread& t2, sql_thread* stored, const table_queries& tq,
+						   compare_stats& stats, hash_pass& hp,
+						   const function<void(const vector<tds::value>&)>& refetch,
+						   const function<void(vector<tds::value>&&)>& changes) {
+	auto n = (uint16_t)tq.pk_columns;
+	batch_cursor s1(t1), s2(t2);
+	optional<batch_cursor> s3;
+
+	if (s1.next_batch())
+		stats.bytes1 += s1.batch().bytes;
+
+	if (s2.next_batch())
+		stats.bytes2 += s2.batch().bytes;
+
+	if (stored) {
+		s3.emplace(*stored);
+		s3->next_batch();
+	}
+
+	auto int_keys = [&](const sql_thread& a, const sql_thread& b) {
+		vector<bool> ret(n);
+
+		for (uint16_t i = 0; i < n; i++) {
+			ret[i] = is_int_type(fixed_width_type(a.cols[i])) && is_int_type(fixed_width_type(b.cols[i]));
+		}
+
+		return ret;
+	};
+
+	auto ik12 = int_keys(t1, t2);
+	auto ik13 = stored ? int_keys(t1, *stored) : vector<bool>{};
+	auto ik23 = stored ? int_keys(t2, *stored) : vector<bool>{};
+
+	unsigned int since_update = 0;
+
+	auto advance = [](batch_cursor& s, atomic<size_t>* bytes) {
+		if (++s.row == s.batch().num_rows && s.next_batch() && bytes)
+			*bytes += s.batch().bytes;
+	};
+
+	while (!s1.finished || !s2.finished || (s3 && !s3->finished)) {
+		bool in1 = !s1.finished, in2 = !s2.finished, in3 = s3 && !s3->finished;
+
+		// work out which of the streams are on the lowest key
+
+		if (in1 && in2) {
+			auto cmp = compare_keys(s1, s2, ik12, n);
+
+			if (cmp == weak_ordering::less)
+				in2 = false;
+			else if (cmp == weak_ordering::greater)
+				in1 = false;
+		}
+
+		if (in3 && (in1 || in2)) {
+			auto cmp = in1 ? compare_keys(s1, *s3, ik13, n) : compare_keys(s2, *s3, ik23, n);
+
+			if (cmp == weak_ordering::less)
+				in3 = false;
+			else if (cmp == weak_ordering::greater)
+				in1 = in2 = false;
+		}
+
+		optional<span<const uint8_t>> h1, h2, prev1, prev2;
+
+		if (in1)
+			h1 = hash_value(s1, n);
+
+		if (in2)
+			h2 = hash_value(s2, n);
+
+		if (in3) {
+			prev1 = hash_value(*s3, n);
+			prev2 = hash_value(*s3, n + 1);
+		}
+
+		if (!hashes_equal(h1, prev1) || !hashes_equal(h2, prev2)) {
+			auto& s = in1 ? s1 : (in2 ? s2 : *s3);
+			vector<tds::value> key;
+
+			key.reserve(n + 2);
+
+			for (uint16_t i = 0; i < n; i++) {
+				key.emplace_back(s.load(s.row, i));
+			}
+
+			if (!in1 || !in2 || !hashes_equal(h1, h2))
+				refetch(key);
+
+			if (changes) {
+				key.emplace_back(in1 ? tds::value(s1.load(s1.row, n)) : tds::value(nullptr));
+				key.emplace_back(in2 ? tds::value(s2.load(s2.row, n)) : tds::value(nullptr));
+
+				changes(move(key));
+			}
+		}
+
+		if (in1) {
+			hp.rows1++;
+			advance(s1, &stats.bytes1);
+		}
+
+		if (in2) {
+			hp.rows2++;
+			advance(s2, &stats.bytes2);
+		}
+
+		if (in3)
+			advance(*s3, nullptr);
+
+		// the counts are passed on every so often, so that the progress in the log moves
+		// during this pass
+
+		if (++since_update == 10000) {
+			stats.rows1 = hp.rows1;
+			stats.rows2 = hp.rows2;
+			since_update = 0;
+		}
+	}
+
+	stats.rows1 = hp.rows1;
+	stats.rows2 = hp.rows2;
+}
+
+// Creates the temporary table on the connection which the keys to refetch are sent to.
+// #keys is copied from the source table, so that its columns have the same collations
+// and the join can't conflict - the UNION ALL stops it taking on an IDENTITY.
+
+static void create_refetch_table(tds::tds& tds, const table_queries& tq, u16string_view from) {
+	u16string key_cols;
+
+	for (unsigned int i = 0; i < tq.pk_columns; i++) {
+		if (i != 0)
+			key_cols += u", ";
+
+		key_cols += tq.cols[i];
+	}
+
+	tds.run(tds::no_check{u"SELECT TOP (0) " + key_cols + u" INTO #keys FROM " + u16string(from) +
+						  u" UNION ALL SELECT TOP (0) " + key_cols + u" FROM " + u16string(from)});
+}
+
+// Returns a query for the full rows that match the keys in #keys.
+
+static u16string refetch_query(const table_queries& tq, u16string_view from) {
+	u16string q;
+
+	for (const auto& col : tq.cols) {
+		if (q.empty())
+			q = u"SELECT ";
+		else
+			q += u", ";
+
+		q += u"t." + col;
+	}
+
+	q += u" FROM " + u16string(from) + u" t JOIN #keys k ON " + key_join(tq.pk, u"t", u"k") + u" ORDER BY ";
+
+	for (unsigned int i = 0; i < tq.pk_columns; i++) {
+		if (i != 0)
+			q += u", ";
+
+		q += u"t." + tq.cols[i];
+	}
+
+	return q;
+}
+
+// In warm mode only the keys which changed were compared, so the counts are taken from
+// the results table once the new results are in, to cover the keys left as they were.
+
+static void recount_results(tds::tds& tds, u16string_view results_table, const vector<pk_col>& pk,
+							compare_stats& stats) {
+	u16string cols;
+
+	for (const auto& p : pk) {
+		cols += tds::escape(p.name) + u", ";
+	}
+
+	stats.changed_rows = stats.added_rows = stats.removed_rows = 0;
+
+	tds::query sq(tds, tds::no_check{u"SELECT change, COUNT(*) FROM (SELECT DISTINCT " + cols + u"change FROM " + u16string(results_table) + u") r GROUP BY change"});
+
+	while (sq.fetch_row()) {
+		auto change = (string)sq[0];
+		auto count = (unsigned int)sq[1];
+
+		if (change == "modified")
+			stats.changed_rows = count;
+		else if (change == "added")
+			stats.added_rows = count;
+		else if (change == "removed")
+			stats.removed_rows = count;
+	}
+}
+
+static void update_log(tds::tds& tds, const compare_stats& stats, unsigned int log_id) {
+	tds.run("UPDATE Comparer.log SET rows1=?, rows2=?, changed_rows=?, added_rows=?, removed_rows=?, bytes1=?, bytes2=?, end_date=SYSDATETIME() WHERE id=?",
+			stats.rows1.load(), stats.rows2.load(), stats.changed_rows.load(), stats.added_rows.load(),
+			stats.removed_rows.load(), (int64_t)stats.bytes1.load(), (int64_t)stats.bytes2.load(), log_id);
+}
+
+// Queue depths, as sampled by the reporter thread.
+
+struct queue_sample {
+	double seconds;
+	size_t queue1, queue2, bcp_queue, memory;
+};
+
+// Writes the pipeline metrics to Comparer.log_stats, if comparer --setup has created it,
+// and to a JSON file if one was asked for. Totals have a NULL in seconds, and the samples
+// have the time since the start.
+
+static void write_pipeline_stats(tds::tds& tds, const vector<pair<string, int64_t>>& totals,
+								 const vector<queue_sample>& samples, unsigned int log_id) {
+	bool have_table;
+
+	{
+		tds::query sq(tds, "SELECT OBJECT_ID('Comparer.log_stats')");
+
+		have_table = sq.fetch_row() && !sq[0].is_null;
+	}
+
+	if (have_table) {
+		list<vector<tds::value>> rows;
+
+		for (const auto& [metric, value] : totals) {
+			rows.push_back({log_id, nullptr, metric, value});
+		}
+
+		for (const auto& qs : samples) {
+			rows.push_back({log_id, qs.seconds, "queue1", (int64_t)qs.queue1});
+			rows.push_back({log_id, qs.seconds, "queue2", (int64_t)qs.queue2});
+			rows.push_back({log_id, qs.seconds, "bcp_queue", (int64_t)qs.bcp_queue});
+			rows.push_back({log_id, qs.seconds, "memory_bytes", (int64_t)qs.memory});
+		}
+
+		tds.bcp(u"Comparer.log_stats", array{ u"log_id", u"seconds", u"metric", u"value" }, rows);
+	}
+
+	if (stats_json.empty())
+		return;
+
+	ofstream f(stats_json);
+
+	if (!f)
+		throw formatted_error("Unable to open {} for writing.", stats_json);
+
+	f << format("{{\n\t\"log_id\": {},\n\t\"totals\": {{", log_id);
+
+	for (size_t i = 0; i < totals.size(); i++) {
+		f << format("{}\n\t\t\"{}\": {}", i == 0 ? "" : ",", totals[i].first, totals[i].second);
+	}
+
+	f << "\n\t},\n\t\"samples\": [";
+
+	for (size_t i = 0; i < samples.size(); i++) {
+		const auto& qs = samples[i];
+
+		f << format("{}\n\t\t{{ \"seconds\": {:.1f}, \"queue1\": {}, \"queue2\": {}, \"bcp_queue\": {}, \"memory_bytes\": {} }}",
+					i == 0 ? "" : ",", qs.seconds, qs.queue1, qs.queue2, qs.bcp_queue, qs.memory);
+	}
+
+	f << "\n\t]\n}\n";
+}
+
+// Waits until each of the servers has room for another connection, unless it has none
+// open, so that a compare needing more than the limit can still run on its own.
+
+void connection_limits::acquire(const vector<string>& servers) {
+	if (limit == 0)
+		return;
+
+	unique_lock ul(lock);
+
+	cv.wait(ul, [&]() {
+		map<string, unsigned int> need;
+
+		for (const auto& s : servers) {
+			need[s]++;
+		}
+
+		for (const auto& [s, n] : need) {
+			auto it = open.find(s);
+
+			if (it != open.end() && it->second != 0 && it->second + n > limit)
+				return false;
+		}
+
+		return true;
+	});
+
+	for (const auto& s : servers) {
+		open[s]++;
+	}
+}
+
+void connection_limits::release(const vector<string>& servers) noexcept {
+	if (limit == 0)
+		return;
+
+	{
+		lock_guard<mutex> lg(lock);
+
+		for (const auto& s : servers) {
+			open[s]--;
+		}
+	}
+
+	cv.notify_all();
+}
+
+// A pooled connection is checked before it's handed out, in case it's been dropped while
+// it was idle.
+
+unique_ptr<tds::tds> connection_pool::get(const string& server, unsigned int rate_limit) {
+	while (enabled) {
+		unique_ptr<tds::tds> conn;
+
+		{
+			lock_guard<mutex> lg(lock);
+
+			auto it = idle.find({server, rate_limit});
+
+			if (it == idle.end() || it->second.empty())
+				break;
+
+			conn = move(it->second.back());
+			it->second.pop_back();
+		}
+
+		try {
+			conn->run("SELECT 1");
+
+			return conn;
+		} catch (...) {
+		}
+	}
+
+	tds::options opts(server, db_username, db_password, DB_APP);
+
+	if (rate_limit != 0)
+		opts.rate_limit = rate_limit;
+
+	return make_unique<tds::tds>(opts);
+}
+
+// Only connections which finished cleanly should be put back, as one which failed part
+// of the way through a query can't be trusted. The temporary tables a compare creates
+// are dropped, so that the next one can create them again.
+
+void connection_pool::put(const string& server, unsigned int rate_limit, unique_ptr<tds::tds> conn) noexcept {
+	if (!enabled || !conn)
+		return;
+
+	try {
+		conn->run("IF @@TRANCOUNT > 0 ROLLBACK; DROP TABLE IF EXISTS #keys, #changes;");
+
+		lock_guard<mutex> lg(lock);
+
+		idle[{server, rate_limit}].push_back(move(conn));
+	} catch (...) {
+	}
+}
+
+static void do_compare(unsigned int num, unsigned int& log_id) {
+	auto conn = connections.get(db_server, 0);
+	auto& tds = *conn;
+
+	table_queries tq;
+	u16string results_table, tbl1, tbl2;
+
+	{
+		tds::query sq(tds, u"SELECT table1, table2 FROM Comparer.queries WHERE id = ?", num);
+
+		if (!sq.fetch_row())
+			throw runtime_error("Unable to find entry in Comparer.queries");
+
+		if (sq[0].is_null)
+			throw runtime_error("table1 is NULL");
+
+		if (sq[1].is_null)
+			throw runtime_error("table2 is NULL");
+
+		tbl1 = (u16string)sq[0];
+		tbl2 = (u16string)sq[1];
+	}
+
+	create_queries(tds, tbl1, tbl2, tq);
+
+	repartition_results_table(tds, num);
+
+	bool incremental = incremental_mode && tq.pk_columns > 0;
+	bool warm = incremental && hash_index_usable(tds, num, tq.pk);
+
+	// with --staging, the results are loaded into a heap, which gets indexed afterwards
+	// and then swapped in for the old results
+
+	bool staged = staging_mode && !warm;
+	optional<int32_t> staging_part;
+	u16string legacy_table = u"Comparer.results";
+	vector<u16string> staging_indexes;
+
+	if (warm) // only the keys which have changed get new results
+		results_table = u"Comparer.results" + to_u16string(num);
+	else if (!tq.pk.empty())
+		create_results_table(tds, tq.pk, num, results_table, tq.pk_only, staged);
+	else if (staged && (staging_part = results_partition(tds, num)).has_value()) {
+		auto staging = u"Comparer.results_staging" + to_u16string(num);
+		auto indexes = results_index_statements(tds, staging);
+
+		if (!indexes.has_value()) {
+			cerr << "Comparer.results has indexes which can't be copied, so loading into it directly." << endl;
+			staging_part.reset();
+		} else {
+			staging_indexes = move(indexes.value());
+			legacy_table = staging;
+
+			tds.run(tds::no_check{u"DROP TABLE IF EXISTS " + staging});
+			tds.run(tds::no_check{u"SELECT TOP (0) * INTO " + staging + u" FROM Comparer.results"});
+		}
+	}
+
+	if (incremental && !warm)
+		create_hash_table(tds, num, tq.pk);
+
+	// in two-phase mode, only the keys and a hash of the rest of the row are sent to
+	// begin with, and the full rows are fetched for the keys which differ
+
+	bool hashed = incremental || (two_phase_mode && tq.pk_columns > 0);
+
+	// a quarter of the memory budget is shared out between the connections' packet buffers,
+	// across all the compares which might be running at once
+
+	auto packets = mem_budget.limit / 4 / PACKET_SIZE / (2 * parallel_ranges * batch_workers);
+
+	auto rate_limit = (unsigned int)clamp<size_t>(packets, MIN_PACKETS, MAX_PACKETS);
+
+	// a side read from a file doesn't need a connection, and one read from a server can have
+	// one for each range
+
+	struct connection_lease {
+		~connection_lease() {
+			server_connections.release(servers);
+		}
+
+		vector<string> servers;
+	};
+
+	vector<string> servers;
+
+	for (unsigned int i = 0; i < parallel_ranges; i++) {
+		if (file1.empty())
+			servers.push_back(tq.server1);
+
+		if (file2.empty())
+			servers.push_back(tq.server2);
+	}
+
+	if (hashed) { // the hash pass has a second connection to each, for the keys to refetch
+		servers.push_back(tq.server1);
+		servers.push_back(tq.server2);
+	}
+
+	server_connections.acquire(servers);
+
+	connection_lease lease{move(servers)};
+	unique_ptr<tds::tds> tds1, tds2;
+
+	if (file1.empty())
+		tds1 = connections.get(tq.server1, rate_limit);
+
+	if (file2.empty())
+		tds2 = connections.get(tq.server2, rate_limit);
+
+	vector<u16string> preds;
+	compare_stats stats;
+	u16string q1 = tq.q1, q2 = tq.q2, order_by = tq.order_by;
+	hash_pass hp;
+
+	// in unsorted mode the rows are put in order here rather than on the servers
+
+	if (unsorted_mode)
+		order_by.clear();
+
+	// with --save-snapshot, the first stream is written out as it's read, so that the
+	// next run can compare against it with --file2
+
+	optional<snapshot_writer> snapshot;
+
+	if (!save_snapshot.empty())
+		snapshot.emplace(save_snapshot);
+
+	list<sql_thread> t1s, t2s;
+	optional<bcp_thread> b;
+	atomic<bool> streaming = false; // once t1s, t2s and b are set up
+	jthread reporter;
+	vector<queue_sample> samples;
+	auto run_start = chrono::steady_clock::now();
+
+	{
+		tds::query sq(tds, "INSERT INTO Comparer.log(date, query, success, error) OUTPUT inserted.id VALUES(GETDATE(), ?, 0, 'Interrupted.')", num);
+
+		if (!sq.fetch_row())
+			throw runtime_error("Error creating log entry.");
+
+		log_id = (unsigned int)sq[0];
+	}
+
+	// Progress gets written to the log from its own connection every so often, so that
+	// the compare never has to wait for it. This starts before the hash or checksum pass,
+	// which can take up most of the time.
+
+	reporter = jthread([&](stop_token stop) noexcept {
+		try {
+			auto rconn = connections.get(db_server, 0);
+			condition_variable_any cv;
+			mutex m;
+			unique_lock ul(m);
+
+			while (true) {
+				cv.wait_for(ul, stop, REPORT_INTERVAL, []() { return false; });
+
+				if (stop.stop_requested())
+					break;
+
+				if (streaming) {
+					queue_sample qs{chrono::duration<double>(chrono::steady_clock::now() - run_start).count(),
+									0, 0, b->queued, mem_budget.in_use()};
+
+					for (const auto& t : t1s) {
+						qs.queue1 += t.queued;
+					}
+
+					for (const auto& t : t2s) {
+						qs.queue2 += t.queued;
+					}
+
+					samples.push_back(qs);
+				}
+
+				update_log(*rconn, stats, log_id);
+			}
+
+			connections.put(db_server, 0, move(rconn));
+		} catch (...) {
+			// progress is only for information, so a failure here isn't fatal
+		}
+	});
+
+	if (hashed) {
+		vector<u16string> names;
+		list<vector<tds::value>> pending;
+		function<void(vector<tds::value>&&)> changes;
+
+		if (incremental) {
+			for (const auto& p : tq.pk) {
+				names.emplace_back(p.name);
+			}
+
+			names.emplace_back(u"hash1");
+			names.emplace_back(u"hash2");
+
+			create_key_table(tds, u"#changes", tq.pk, true);
+
+			changes = [&](vector<tds::value>&& v) {
+				pending.push_back(move(v));
+
+				if (pending.size() >= 10000) {
+					tds.bcp(u"#changes", names, pending);
+					pending.clear();
+				}
+			};
+		}
+
+		// The keys which differ are sent to #keys as they're found, on a second connection
+		// to each server as the first is busy with the hash query, so that they're never
+		// all held here at once.
+
+		vector<u16string> key_names;
+		list<vector<tds::value>> refetch;
+
+		for (const auto& p : tq.pk) {
+			key_names.emplace_back(p.name);
+		}
 
-	{
-		tds::query sq(tds, "SELECT * FROM sys.partition_range_values WHERE function_id = ? AND value = ?", func_num, next_num);
+		auto keys1 = connections.get(tq.server1, rate_limit);
+		auto keys2 = connections.get(tq.server2, rate_limit);
 
-		part_found = sq.fetch_row();
-	}
+		create_refetch_table(*keys1, tq, tq.from1);
+		create_refetch_table(*keys2, tq, tq.from2);
 
-	if (part_found)
-		return;
+		auto send_refetch = [&]() {
+			keys1->bcp(u"#keys", key_names, refetch);
+			keys2->bcp(u"#keys", key_names, refetch);
+			refetch.clear();
+		};
 
-	tds.run("ALTER PARTITION SCHEME comparer_part_scheme NEXT USED [PRIMARY]");
-	tds.run("ALTER PARTITION FUNCTION comparer_part_func() SPLIT RANGE(?)", next_num);
-}
+		auto add_refetch = [&](const vector<tds::value>& key) {
+			refetch.push_back(key);
 
-static void delete_old_results(tds::tds& tds, unsigned int num) {
-	bool partitioned;
-	int32_t part_num;
+			if (refetch.size() >= 10000)
+				send_refetch();
+		};
 
-	{
-		tds::query sq(tds, "SELECT function_id FROM sys.partition_functions WHERE name = 'comparer_part_func'");
+		auto key_query = [&](u16string_view from) {
+			u16string q = u"SELECT ";
 
-		partitioned = sq.fetch_row();
-	}
+			for (unsigned int i = 0; i < tq.pk_columns; i++) {
+				q += tq.cols[i] + u", ";
+			}
+
+			return q + row_hash_expression(tq) + u" FROM " + u16string(from) + tq.order_by;
+		};
 
-	if (partitioned) {
 		{
-			tds::query sq(tds, "SELECT $PARTITION.comparer_part_func(?)", num);
+			sql_thread h1(key_query(tq.from1), tds1);
+			sql_thread h2(key_query(tq.from2), tds2);
+			unique_ptr<tds::tds> tds3;
+			optional<sql_thread> h3;
+
+			if (warm) {
+				u16string q = u"SELECT ";
+
+				for (unsigned int i = 0; i < tq.pk_columns; i++) {
+					q += tq.cols[i] + u", ";
+				}
 
-			if (!sq.fetch_row())
-				throw runtime_error("Unable to get partition number to truncate.");
+				tds3 = connections.get(db_server, 0);
+				h3.emplace(q + u"hash1, hash2 FROM " + hash_table_name(num) + tq.order_by, tds3);
+			}
+
+			compare_hashes(h1, h2, h3 ? &*h3 : nullptr, tq, stats, hp, add_refetch, changes);
+
+			h1.t.join();
+			h2.t.join();
+
+			tds1 = move(h1.uptds);
+			tds2 = move(h2.uptds);
 
-			part_num = (int32_t)sq[0];
+			if (h3) {
+				h3->t.join();
+				connections.put(db_server, 0, move(h3->uptds));
+			}
 		}
 
-		tds.run("TRUNCATE TABLE Comparer.results WITH (PARTITIONS(?))", part_num);
+		connections.put(tq.server1, rate_limit, move(tds1));
+		connections.put(tq.server2, rate_limit, move(tds2));
 
-		return;
+		if (!refetch.empty())
+			send_refetch();
+
+		// the rows which differ are fetched on the connections holding #keys
+
+		tds1 = move(keys1);
+		tds2 = move(keys2);
+
+		if (!pending.empty())
+			tds.bcp(u"#changes", names, pending);
+
+		if (warm)
+			tds.run(tds::no_check{u"DELETE r FROM " + results_table + u" r JOIN #changes c ON " + key_join(tq.pk, u"r", u"c")});
+
+		q1 = refetch_query(tq, tq.from1);
+		q2 = refetch_query(tq, tq.from2);
+		order_by.clear();
+
+		preds.emplace_back();
 	}
 
-	tds.run(R"(
-WHILE 1 = 1
-BEGIN
-	BEGIN TRANSACTION;
+	if (checksum_mode && tq.pk_columns > 0 && preds.empty()) {
+		auto leaves = checksum_ranges(*tds1, *tds2, tq, stats);
 
-	DELETE TOP (100000)
-	FROM Comparer.results
-	WHERE query=?;
+		if (leaves.empty()) // everything matches
+			preds.emplace_back(u"1 = 0");
+		else if (leaves.size() > 1 || !leaves.front().empty()) {
+			// share the leaf ranges out between the parallel ranges, keeping them contiguous
 
-	COMMIT;
+			auto groups = min((size_t)parallel_ranges, leaves.size());
 
-	IF (SELECT COUNT(*) FROM Comparer.results WHERE query=?) = 0
-		BREAK;
-END
-)", num, num);
-}
+			for (size_t i = 0; i < groups; i++) {
+				u16string p;
 
-static size_t row_byte_count(size_t total, const tds::value& v) {
-	if (!v.is_null)
-		total += v.val.size();
+				for (size_t j = i * leaves.size() / groups; j < (i + 1) * leaves.size() / groups; j++) {
+					if (!p.empty())
+						p += u" OR ";
 
-	return total;
-}
+					p += u"(" + leaves[j] + u")";
+				}
 
-static void do_compare(unsigned int num) {
-	tds::tds tds(db_server, db_username, db_password, DB_APP);
+				preds.emplace_back(p);
+			}
+		}
+	}
 
-	u16string q1, q2;
-	string server1, server2;
-	unsigned int pk_columns;
-	vector<pk_col> pk;
-	u16string results_table, tbl1, tbl2;
-	bool pk_only = false;
+	if (preds.empty() && parallel_ranges > 1 && tq.pk_columns > 0)
+		preds = get_range_predicates(*tds1, tq.from1, tq.pk.front(), parallel_ranges);
 
-	{
-		tds::query sq(tds, u"SELECT table1, table2 FROM Comparer.queries WHERE id = ?", num);
+	if (preds.empty())
+		preds.emplace_back();
 
-		if (!sq.fetch_row())
-			throw runtime_error("Unable to find entry in Comparer.queries");
+	for (const auto& p : preds) {
+		auto where = p.empty() ? u16string{} : u" WHERE " + p;
 
-		if (sq[0].is_null)
-			throw runtime_error("table1 is NULL");
+		auto tee = snapshot ? &*snapshot : nullptr;
 
-		if (sq[1].is_null)
-			throw runtime_error("table2 is NULL");
+		if (!file1.empty())
+			t1s.emplace_back(open_file_source(file1), tee, unsorted_mode ? 0 : tq.pk_columns);
+		else {
+			if (!tds1)
+				tds1 = connections.get(tq.server1, rate_limit);
 
-		tbl1 = (u16string)sq[0];
-		tbl2 = (u16string)sq[1];
+			t1s.emplace_back(q1 + where + order_by, tds1, tee);
+		}
+
+		if (!file2.empty())
+			t2s.emplace_back(open_file_source(file2), nullptr, unsorted_mode ? 0 : tq.pk_columns);
+		else {
+			if (!tds2)
+				tds2 = connections.get(tq.server2, rate_limit);
+
+			t2s.emplace_back(q2 + where + order_by, tds2);
+		}
 	}
 
-	create_queries(tds, tbl1, tbl2, q1, q2, server1, server2, pk_columns,
-				   pk, pk_only);
+	// In the legacy path, the old results are cleared on another connection while the
+	// compare runs, and the bcp writers are held back until that's finished.
 
-	repartition_results_table(tds, num);
+	bool purge = results_table.empty() && !staging_part.has_value();
+	b.emplace(results_table, tq.pk, tq.pk_only, bcp_writers, legacy_table, purge);
+	streaming = true;
+
+	auto stop_all = [&]() noexcept {
+		for (auto* l : { &t1s, &t2s }) {
+			for (auto& t : *l) {
+				{
+					lock_guard<mutex> lg(t.lock);
 
-	list<vector<pair<tds::value_data_t, bool>>> rows1, rows2;
+					t.finished = true;
+				}
 
-	if (!pk.empty())
-		create_results_table(tds, pk, num, results_table, pk_only);
+				t.cv.notify_all();
+			}
+		}
 
-	auto opts1 = tds::options(server1, db_username, db_password, DB_APP);
-	auto opts2 = tds::options(server2, db_username, db_password, DB_APP);
+		mem_budget.notify();
+	};
 
-	opts1.rate_limit = MAX_PACKETS;
-	opts2.rate_limit = MAX_PACKETS;
+	try {
+		auto run = [&]<bool do_new> {
+			jthread purge_thread;
 
-	auto tds1 = make_unique<tds::tds>(opts1);
-	auto tds2 = make_unique<tds::tds>(opts2);
+			if (purge) {
+				purge_thread = jthread([&]() noexcept {
+					try {
+						auto conn = connections.get(db_server, 0);
 
-	sql_thread t1(q1, tds1);
-	sql_thread t2(q2, tds2);
-	bcp_thread b(results_table, pk, pk_only);
+						delete_old_results(*conn, num);
 
-	auto fetch = [](auto& rows, bool& finished, bool& done, sql_thread& t, auto& cols) {
-		while (rows.empty() && !finished) {
-			finished = done;
+						connections.put(db_server, 0, move(conn));
+					} catch (...) {
+						b->fail(current_exception());
+						return;
+					}
 
-			if (finished)
-				return;
+					b->release();
+				});
+			}
 
-			t.wait_for([&]() noexcept {
-				done = t.finished;
+			vector<exception_ptr> errors(t1s.size());
 
-				if (!t.results.empty()) {
-					rows.splice(rows.end(), t.results);
-					t.cv.notify_all();
+			{
+				list<jthread> workers;
+				auto it1 = next(t1s.begin());
+				auto it2 = next(t2s.begin());
+
+				for (size_t i = 1; i < t1s.size(); i++, it1++, it2++) {
+					workers.emplace_back([&, &t1 = *it1, &t2 = *it2, &err = errors[i]]() noexcept {
+						try {
+							compare_range<do_new>(t1, t2, *b, stats, num, tq.pk_columns, tq.pk_only);
+						} catch (...) {
+							err = current_exception();
+							stop_all();
+						}
+					});
 				}
-			});
 
-			if (t.finished && t.ex)
-				rethrow_exception(t.ex);
+				// the first range runs on this thread
+
+				try {
+					if (unsorted_mode)
+						compare_unsorted<do_new>(t1s.front(), t2s.front(), *b, stats, num, tq.pk_columns, tq.pk_only, spill_dir,
+												 mem_budget.limit / 4 / batch_workers);
+					else
+						compare_range<do_new>(t1s.front(), t2s.front(), *b, stats, num, tq.pk_columns, tq.pk_only);
+				} catch (...) {
+					errors.front() = current_exception();
+					stop_all();
+				}
+			}
 
-			if (rows.empty() && done) {
-				finished = true;
-				return;
+			for (const auto& e : errors) {
+				if (e)
+					rethrow_exception(e);
 			}
-		}
+		};
 
-		auto& rf = rows.front();
+		if (results_table.empty())
+			run.operator()<false>();
+		else
+			run.operator()<true>();
+	} catch (...) {
+		stop_all();
+		throw;
+	}
 
-		for (size_t i = 0; i < rf.size(); i++) {
-			cols[i].val.swap(rf[i].first);
-			cols[i].is_null = rf[i].second;
-		}
+	b->join();
 
-		rows.pop_front();
-	};
+	if (b->exc)
+		rethrow_exception(b->exc);
 
-	unsigned int num_rows1 = 0, num_rows2 = 0, changed_rows = 0, added_rows = 0, removed_rows = 0;
-	size_t bytes1 = 0, bytes2 = 0;
+	if (snapshot)
+		snapshot->finish();
 
-	try {
-		unsigned int rows_since_update = 0, rownum = 0;
-		bool t1_finished = false, t2_finished = false, t1_done = false, t2_done = false;
+	// stop the reporter, so that it can't overwrite the final figures
 
-		{
-			tds::query sq(tds, "INSERT INTO Comparer.log(date, query, success, error) OUTPUT inserted.id VALUES(GETDATE(), ?, 0, 'Interrupted.')", num);
+	reporter.request_stop();
+
+	if (reporter.joinable())
+		reporter.join();
+
+	if (staging_part.has_value())
+		switch_in_results(tds, num, *staging_part, legacy_table, staging_indexes);
+	else if (staged && !tq.pk.empty())
+		finish_staged_results(tds, tq.pk, num, tq.pk_only);
+
+	if (hashed) { // the rows fetched in the second pass were already counted from their hashes
+		stats.rows1 = hp.rows1;
+		stats.rows2 = hp.rows2;
+	}
+
+	if (warm)
+		recount_results(tds, results_table, tq.pk, stats);
 
-			if (!sq.fetch_row())
-				throw runtime_error("Error creating log entry.");
+	if (incremental) {
+		tds::trans trans(tds);
+		u16string cols;
 
-			log_id = (unsigned int)sq[0];
+		for (const auto& p : tq.pk) {
+			cols += tds::escape(p.name) + u", ";
 		}
 
-		auto run = [&]<bool do_new> {
-			if constexpr (!do_new)
-				delete_old_results(tds, num);
+		cols += u"hash1, hash2";
 
-			fetch(rows1, t1_finished, t1_done, t1, t1.cols);
-			fetch(rows2, t2_finished, t2_done, t2, t2.cols);
+		tds.run(tds::no_check{u"DELETE h FROM " + hash_table_name(num) + u" h JOIN #changes c ON " + key_join(tq.pk, u"h", u"c")});
+		tds.run(tds::no_check{u"INSERT INTO " + hash_table_name(num) + u" (" + cols + u") SELECT " + cols + u" FROM #changes WHERE hash1 IS NOT NULL OR hash2 IS NOT NULL"});
 
-			while (!t1_finished || !t2_finished) {
-				list<vector<tds::value>> local_res;
+		trans.commit();
+	}
+
+	tds.run("UPDATE Comparer.log SET success=1, rows1=?, rows2=?, changed_rows=?, added_rows=?, removed_rows=?, bytes1=?, bytes2=?, end_date=SYSDATETIME(), error=NULL WHERE id=?",
+			stats.rows1.load(), stats.rows2.load(), stats.changed_rows.load(), stats.added_rows.load(),
+			stats.removed_rows.load(), (int64_t)stats.bytes1.load(), (int64_t)stats.bytes2.load(), log_id);
 
-				if (b.exc)
-					rethrow_exception(b.exc);
+	// where the time went, to show which stage held the compare up
 
-				if (!t1_finished && !t2_finished) {
-					bytes1 = accumulate(t1.cols.begin(), t1.cols.end(), bytes1, row_byte_count);
-					bytes2 = accumulate(t2.cols.begin(), t2.cols.end(), bytes2, row_byte_count);
+	vector<pair<string, int64_t>> totals;
+	uint64_t fetch1 = 0, fetch2 = 0, blocked1 = 0, blocked2 = 0, starved1 = 0, starved2 = 0;
 
-					auto cmp = compare_cols(t1.cols, t2.cols, pk_columns == 0 ? (unsigned int)t1.cols.size() : pk_columns);
+	for (const auto& t : t1s) {
+		fetch1 += t.fetch_ns;
+		blocked1 += t.blocked_ns;
+		starved1 += t.starved_ns;
+	}
+
+	for (const auto& t : t2s) {
+		fetch2 += t.fetch_ns;
+		blocked2 += t.blocked_ns;
+		starved2 += t.starved_ns;
+	}
 
-					if (cmp == weak_ordering::equivalent) {
-						if (pk_columns > 0) {
-							bool changed = false;
-							string pk;
+	auto ms = [](uint64_t ns) {
+		return (int64_t)(ns / 1000000);
+	};
 
-							for (unsigned int i = pk_columns; i < t1.cols.size(); i++) {
-								const auto& v1 = t1.cols[i];
-								const auto& v2 = t2.cols[i];
+	totals.emplace_back("server1_fetch_ms", ms(fetch1));
+	totals.emplace_back("server2_fetch_ms", ms(fetch2));
+	totals.emplace_back("server1_blocked_ms", ms(blocked1));
+	totals.emplace_back("server2_blocked_ms", ms(blocked2));
+	totals.emplace_back("merge_wait1_ms", ms(starved1));
+	totals.emplace_back("merge_wait2_ms", ms(starved2));
+	totals.emplace_back("merge_ms", ms(stats.merge_ns));
+	totals.emplace_back("bcp_queue_wait_ms", ms(stats.send_wait_ns));
+	totals.emplace_back("bcp_write_ms", ms(b->write_ns));
+	totals.emplace_back("bcp_rows", (int64_t)b->rows_written.load());
+	totals.emplace_back("total_ms", ms(elapsed_ns(run_start)));
 
-								if ((!v1.is_null && v2.is_null) || (!v2.is_null && v1.is_null) || (!v1.is_null && !v2.is_null && !value_cmp(v1, v2))) {
+	try {
+		write_pipeline_stats(tds, totals, samples, log_id);
+	} catch (const exception& e) {
+		// the compare itself succeeded, so don't fail it over this
+		cerr << "Unable to write pipeline stats: " << e.what() << endl;
+	}
 
-									if constexpr (do_new) {
-										vector<tds::value> v;
+	// everything worked, so the connections can be used again
 
-										v.reserve(pk_columns + 5);
+	for (auto& t : t1s) {
+		if (t.t.joinable())
+			t.t.join();
 
-										for (unsigned int j = 0; j < pk_columns; j++) {
-											v.emplace_back(t1.cols[j]);
-										}
+		connections.put(tq.server1, rate_limit, move(t.uptds));
+	}
 
-										v.emplace_back("modified");
-										v.emplace_back(i + 1);
-										v.emplace_back(v1);
-										v.emplace_back(v2);
-										v.emplace_back(t1.cols[i].name);
+	for (auto& t : t2s) {
+		if (t.t.joinable())
+			t.t.join();
 
-										local_res.push_back(v);
-									} else {
-										if (pk.empty())
-											pk = make_pk_string(t1.cols, pk_columns);
+		connections.put(tq.server2, rate_limit, move(t.uptds));
+	}
 
-										local_res.push_back({num, pk, "modified", i + 1, v1, v2, t1.cols[i].name});
-									}
+	connections.put(tq.server1, rate_limit, move(tds1));
+	connections.put(tq.server2, rate_limit, move(tds2));
+	connections.put(db_server, 0, move(conn));
+}
 
-									changed = true;
-								}
-							}
+template<typename T>
+static bool parse_number(string_view sv, T& t) {
+	auto [ptr, ec] = from_chars(sv.data(), sv.data() + sv.length(), t);
 
-							if (changed)
-								changed_rows++;
-						}
+	if (ec != errc() || ptr != sv.data() + sv.length()) {
+		cerr << format("Could not convert \"{}\" to integer.\n", sv);
+		return false;
+	}
 
-						num_rows1++;
-						num_rows2++;
+	return true;
+}
 
-						fetch(rows1, t1_finished, t1_done, t1, t1.cols);
-						fetch(rows2, t2_finished, t2_done, t2, t2.cols);
-					} else if (cmp == weak_ordering::less) {
-						if constexpr (do_new) {
-							vector<tds::value> v;
+// Parses a list of query numbers and ranges, such as "3,7-10,12". The ranges are left for
+// the server to fill in, as they can take in any number of ids which aren't queries.
 
-							v.reserve(pk_columns + 5);
+static bool parse_ids(string_view sv, vector<pair<unsigned int, unsigned int>>& ids) {
+	while (true) {
+		auto comma = sv.find(',');
+		auto item = sv.substr(0, comma);
+		auto dash = item.find('-');
+		unsigned int first, last;
 
-							for (unsigned int j = 0; j < pk_columns; j++) {
-								v.emplace_back(t1.cols[j]);
-							}
+		if (!parse_number(item.substr(0, dash), first))
+			return false;
 
-							v.emplace_back("removed");
+		if (dash == string_view::npos)
+			last = first;
+		else if (!parse_number(item.substr(dash + 1), last))
+			return false;
 
-							if (pk_only)
-								local_res.push_back(v);
-							else {
-								for (unsigned int i = pk_columns; i < t1.cols.size(); i++) {
-									const auto& v1 = t1.cols[i];
+		if (last < first) {
+			cerr << format("Invalid range \"{}\".\n", item);
+			return false;
+		}
 
-									v.emplace_back(i + 1);
+		ids.emplace_back(first, last);
 
-									if (v1.is_null)
-										v.emplace_back(nullptr);
-									else
-										v.emplace_back(v1);
+		if (comma == string_view::npos)
+			break;
 
-									v.emplace_back(nullptr);
-									v.emplace_back(t1.cols[i].name);
+		sv = sv.substr(comma + 1);
+	}
 
-									local_res.push_back(v);
+	return true;
+}
 
-									v.resize(pk_columns + 1);
-								}
-							}
-						} else {
-							const auto& pk = pk_columns == 0 ? pseudo_pk(rownum) : make_pk_string(t1.cols, pk_columns);
+// Works out which queries a batch is made of, and puts the biggest first, going by how
+// many bytes their last successful run read. That way the small ones get packed in
+// around them, rather than a big one being left running on its own at the end. Ones
+// which have never succeeded are treated as big.
 
-							if (pk_only)
-								local_res.push_back({num, pk, "removed", 0, nullptr, nullptr, nullptr});
-							else {
-								for (unsigned int i = pk_columns; i < t1.cols.size(); i++) {
-									const auto& v1 = t1.cols[i];
+static vector<unsigned int> plan_batch(const vector<pair<unsigned int, unsigned int>>& ranges, const string& group) {
+	tds::tds tds(db_server, db_username, db_password, DB_APP);
+	map<unsigned int, int64_t> sizes;
+	vector<unsigned int> ids;
 
-									if (v1.is_null)
-										local_res.push_back({num, pk, "removed", i + 1, nullptr, nullptr, t1.cols[i].name});
-									else
-										local_res.push_back({num, pk, "removed", i + 1, v1, nullptr, t1.cols[i].name});
-								}
-							}
-						}
+	if (!group.empty()) {
+		{
+			tds::query sq(tds, "SELECT COL_LENGTH('Comparer.queries', 'query_group')");
 
-						removed_rows++;
-						num_rows1++;
+			if (!sq.fetch_row() || sq[0].is_null)
+				throw runtime_error("Comparer.queries has no query_group column. Run comparer --setup to add it.");
+		}
 
-						fetch(rows1, t1_finished, t1_done, t1, t1.cols);
-					} else {
-						if constexpr (do_new) {
-							vector<tds::value> v;
+		tds::query sq(tds, "SELECT id FROM Comparer.queries WHERE query_group = ? ORDER BY id", group);
 
-							v.reserve(pk_columns + 5);
+		while (sq.fetch_row()) {
+			ids.push_back((unsigned int)sq[0]);
+		}
 
-							for (unsigned int j = 0; j < pk_columns; j++) {
-								v.emplace_back(t2.cols[j]);
-							}
+		if (ids.empty())
+			throw formatted_error("No queries found in group {}.", group);
+	} else {
+		for (const auto& [first, last] : ranges) {
+			tds::query sq(tds, "SELECT id FROM Comparer.queries WHERE id BETWEEN ? AND ? ORDER BY id", first, last);
 
-							v.emplace_back("added");
+			while (sq.fetch_row()) {
+				ids.push_back((unsigned int)sq[0]);
+			}
+		}
 
-							if (pk_only)
-								local_res.push_back(v);
-							else {
-								for (unsigned int i = pk_columns; i < t1.cols.size(); i++) {
-									const auto& v2 = t2.cols[i];
+		if (ids.empty())
+			throw runtime_error("None of the query numbers given are in Comparer.queries.");
 
-									v.emplace_back(i + 1);
-									v.emplace_back(nullptr);
+		sort(ids.begin(), ids.end());
+		ids.erase(unique(ids.begin(), ids.end()), ids.end());
+	}
 
-									if (v2.is_null)
-										v.emplace_back(nullptr);
-									else
-										v.emplace_back(v2);
+	{
+		tds::query sq(tds, R"(SELECT query, bytes1 + bytes2
+FROM (
+	SELECT query, bytes1, bytes2, ROW_NUMBER() OVER (PARTITION BY query ORDER BY id DESC) AS rn
+	FROM Comparer.log
+	WHERE success = 1
+) l
+WHERE rn = 1)");
+
+		while (sq.fetch_row()) {
+			if (!sq[0].is_null && !sq[1].is_null)
+				sizes[(unsigned int)sq[0]] = (int64_t)sq[1];
+		}
+	}
 
-									v.emplace_back(t2.cols[i].name);
+	auto size = [&](unsigned int num) {
+		auto it = sizes.find(num);
 
-									local_res.push_back(v);
+		return it == sizes.end() ? numeric_limits<int64_t>::max() : it->second;
+	};
 
-									v.resize(pk_columns + 1);
-								}
-							}
-						} else {
-							const auto& pk = pk_columns == 0 ? pseudo_pk(rownum) : make_pk_string(t2.cols, pk_columns);
+	stable_sort(ids.begin(), ids.end(), [&](unsigned int a, unsigned int b) {
+		return size(a) > size(b);
+	});
 
-							if (pk_only)
-								local_res.push_back({num, pk, "added", 0, nullptr, nullptr, nullptr});
-							else {
-								for (unsigned int i = pk_columns; i < t2.cols.size(); i++) {
-									const auto& v2 = t2.cols[i];
+	return ids;
+}
 
-									if (v2.is_null)
-										local_res.push_back({num, pk, "added", i + 1, nullptr, nullptr, t2.cols[i].name});
-									else
-										local_res.push_back({num, pk, "added", i + 1, nullptr, v2, t2.cols[i].name});
-								}
-							}
-						}
+// Makes the changes to the Comparer schema which the optional features need. This is
+// only done when asked for, never as a side effect of a compare.
 
-						added_rows++;
-						num_rows2++;
+static void setup_schema() {
+	tds::tds tds(db_server, db_username, db_password, DB_APP);
 
-						fetch(rows2, t2_finished, t2_done, t2, t2.cols);
-					}
-				} else if (!t1_finished) {
-					bytes1 = accumulate(t1.cols.begin(), t1.cols.end(), bytes1, row_byte_count);
+	tds.run(R"(IF COL_LENGTH('Comparer.queries', 'query_group') IS NULL
+	ALTER TABLE Comparer.queries ADD query_group VARCHAR(128) NULL;)");
+
+	tds.run(R"(IF OBJECT_ID('Comparer.queue') IS NULL
+	CREATE TABLE Comparer.queue (
+		id INT IDENTITY NOT NULL PRIMARY KEY,
+		query INT NOT NULL,
+		added DATETIME2 NOT NULL DEFAULT SYSDATETIME(),
+		owner VARCHAR(150) NULL,
+		claimed_at DATETIME2 NULL
+	);)");
+
+	tds.run(R"(IF COL_LENGTH('Comparer.queue', 'claimed_at') IS NULL
+	ALTER TABLE Comparer.queue ADD owner VARCHAR(150) NULL, claimed_at DATETIME2 NULL;)");
+
+	tds.run(R"(IF OBJECT_ID('Comparer.metadata_cache') IS NULL
+	CREATE TABLE Comparer.metadata_cache (
+		table_name NVARCHAR(448) NOT NULL,
+		column_order INT NOT NULL,
+		modify_date DATETIME NOT NULL,
+		name NVARCHAR(128) NOT NULL,
+		key_type NVARCHAR(128) NULL,
+		is_descending BIT NOT NULL,
+		is_nullable BIT NOT NULL,
+		PRIMARY KEY (table_name, column_order)
+	);)");
+
+	tds.run(R"(IF OBJECT_ID('Comparer.log_stats') IS NULL
+	CREATE TABLE Comparer.log_stats (
+		log_id INT NOT NULL,
+		seconds FLOAT NULL,
+		metric VARCHAR(50) NOT NULL,
+		value BIGINT NOT NULL
+	);)");
+}
 
-					if constexpr (do_new) {
-						vector<tds::value> v;
+// Runs one compare, recording any failure against it in Comparer.log.
 
-						v.reserve(pk_columns + 5);
+static bool run_compare(unsigned int num, bool batch) noexcept {
+	unsigned int log_id = 0;
 
-						for (unsigned int j = 0; j < pk_columns; j++) {
-							v.emplace_back(t1.cols[j]);
-						}
+	try {
+		do_compare(num, log_id);
+	} catch (const exception& e) {
+		if (batch)
+			cerr << format("Query {}: exception: {}\n", num, e.what());
+		else
+			cerr << "Exception: " << e.what() << endl;
+
+		try {
+			tds::tds tds(db_server, db_username, db_password, DB_APP);
+
+			if (log_id == 0)
+				tds.run("INSERT INTO Comparer.log(query, success, error) VALUES(?, 0, ?)", num, e.what());
+			else
+				tds.run("UPDATE Comparer.log SET error=?, end_date=GETDATE() WHERE id=?", e.what(), log_id);
+		} catch (...) {
+		}
+
+		return false;
+	}
 
-						v.emplace_back("removed");
+	return true;
+}
 
-						if (pk_only)
-							local_res.push_back(v);
-						else {
-							for (unsigned int i = pk_columns; i < t1.cols.size(); i++) {
-								const auto& v1 = t1.cols[i];
+// Each worker takes the next compare off the list once it's finished its last one.
+// Returns false if any of them failed.
 
-								v.emplace_back(i + 1);
+static bool run_batch(const vector<unsigned int>& ids) {
+	atomic<size_t> next = 0;
+	atomic<bool> success = true;
 
-								if (v1.is_null)
-									v.emplace_back(nullptr);
-								else
-									v.emplace_back(v1);
+	{
+		vector<jthread> workers;
 
-								v.emplace_back(nullptr);
-								v.emplace_back(t1.cols[i].name);
+		for (unsigned int i = 0; i < batch_workers; i++) {
+			workers.emplace_back([&]() noexcept {
+				for (auto n = next++; n < ids.size(); n = next++) {
+					if (!run_compare(ids[n], true))
+						success = false;
+				}
+			});
+		}
+	}
 
-								local_res.push_back(v);
+	return success;
+}
 
-								v.resize(pk_columns + 1);
-							}
-						}
-					} else {
-						const auto& pk = pk_columns == 0 ? pseudo_pk(rownum) : make_pk_string(t1.cols, pk_columns);
-
-						if (pk_only)
-							local_res.push_back({num, pk, "removed", 0, nullptr, nullptr, nullptr});
-						else {
-							for (unsigned int i = pk_columns; i < t1.cols.size(); i++) {
-								const auto& v1 = t1.cols[i];
-
-								if (v1.is_null)
-									local_res.push_back({num, pk, "removed", i + 1, nullptr, nullptr, t1.cols[i].name});
-								else
-									local_res.push_back({num, pk, "removed", i + 1, v1, nullptr, t1.cols[i].name});
-							}
-						}
-					}
+// In service mode, the workers take compares off Comparer.queue as they're added. A row
+// is claimed by marking it with the worker's connection and the time, with READPAST so
+// that other workers, or other services, skip over rows which are already being
+// claimed. The claim is renewed while the compare runs, and the row is only deleted once
+// it's finished, so that if the process dies the claim goes stale and another worker
+// picks the row up again.
+
+struct queued_compare {
+	unsigned int id;
+	unsigned int query;
+	string owner;
+};
+
+static optional<queued_compare> claim_queued(tds::tds& tds) {
+	tds::query sq(tds, R"(WITH q AS (
+	SELECT TOP (1) id, query, owner, claimed_at
+	FROM Comparer.queue WITH (ROWLOCK, READPAST, UPDLOCK)
+	WHERE claimed_at IS NULL OR claimed_at < DATEADD(SECOND, -?, SYSDATETIME())
+	ORDER BY id
+)
+UPDATE q SET owner = CONCAT(HOST_NAME(), ':', @@SPID), claimed_at = SYSDATETIME()
+OUTPUT inserted.id, inserted.query, inserted.owner)", CLAIM_TIMEOUT);
 
-					removed_rows++;
-					num_rows1++;
+	if (!sq.fetch_row())
+		return nullopt;
 
-					fetch(rows1, t1_finished, t1_done, t1, t1.cols);
-				} else {
-					bytes2 = accumulate(t2.cols.begin(), t2.cols.end(), bytes2, row_byte_count);
+	return queued_compare{(unsigned int)sq[0], (unsigned int)sq[1], (string)sq[2]};
+}
 
-					if constexpr (do_new) {
-						vector<tds::value> v;
+// Keeps the claim on a queued compare fresh until stop is requested.
 
-						v.reserve(pk_columns + 5);
+static void renew_claim(tds::tds& tds, const queued_compare& qc, stop_token stop) noexcept {
+	condition_variable_any cv;
+	mutex m;
+	unique_lock ul(m);
 
-						for (unsigned int j = 0; j < pk_columns; j++) {
-							v.emplace_back(t2.cols[j]);
-						}
+	while (true) {
+		cv.wait_for(ul, stop, CLAIM_HEARTBEAT, []() { return false; });
 
-						v.emplace_back("added");
+		if (stop.stop_requested())
+			break;
 
-						if (pk_only)
-							local_res.push_back(v);
-						else {
-							for (unsigned int i = pk_columns; i < t1.cols.size(); i++) {
-								const auto& v2 = t2.cols[i];
+		try {
+			tds.run("UPDATE Comparer.queue SET claimed_at = SYSDATETIME() WHERE id = ? AND owner = ?", qc.id, qc.owner);
+		} catch (...) {
+			// if this keeps failing the claim goes stale, and the compare gets run again
+		}
+	}
+}
+
+static void run_service() {
+	{
+		tds::tds tds(db_server, db_username, db_password, DB_APP);
+		tds::query sq(tds, "SELECT COL_LENGTH('Comparer.queue', 'claimed_at')");
 
-								v.emplace_back(i + 1);
-								v.emplace_back(nullptr);
+		if (!sq.fetch_row() || sq[0].is_null)
+			throw runtime_error("Comparer.queue is missing or out of date. Run comparer --setup to create it.");
+	}
 
-								if (v2.is_null)
-									v.emplace_back(nullptr);
-								else
-									v.emplace_back(v2);
+	vector<jthread> workers;
 
-								v.emplace_back(t2.cols[i].name);
+	for (unsigned int i = 0; i < batch_workers; i++) {
+		workers.emplace_back([]() noexcept {
+			unique_ptr<tds::tds> queue_conn;
 
-								local_res.push_back(v);
+			while (true) {
+				optional<queued_compare> qc;
 
-								v.resize(pk_columns + 1);
-							}
-						}
-					} else {
-						const auto& pk = pk_columns == 0 ? pseudo_pk(rownum) : make_pk_string(t2.cols, pk_columns);
-
-						if (pk_only)
-							local_res.push_back({num, pk, "added", 0, nullptr, nullptr, nullptr});
-						else {
-							for (unsigned int i = pk_columns; i < t2.cols.size(); i++) {
-								const auto& v2 = t2.cols[i];
-
-								if (v2.is_null)
-									local_res.push_back({num, pk, "added", i + 1, nullptr, nullptr, t2.cols[i].name});
-								else
-									local_res.push_back({num, pk, "added", i + 1, nullptr, v2, t2.cols[i].name});
-							}
-						}
-					}
+				try {
+					if (!queue_conn)
+						queue_conn = make_unique<tds::tds>(db_server, db_username, db_password, DB_APP);
 
-					added_rows++;
-					num_rows2++;
+					qc = claim_queued(*queue_conn);
+				} catch (const exception& e) {
+					cerr << format("Unable to read Comparer.queue: {}\n", e.what());
+					queue_conn.reset();
+				}
 
-					fetch(rows2, t2_finished, t2_done, t2, t2.cols);
+				if (!qc) {
+					this_thread::sleep_for(poll_interval);
+					continue;
 				}
 
-				if (!local_res.empty()) {
-					{
-						lock_guard<mutex> lg(b.lock);
+				{
+					jthread heartbeat([&](stop_token stop) noexcept {
+						renew_claim(*queue_conn, *qc, stop);
+					});
 
-						b.res.splice(b.res.end(), local_res);
-					}
+					run_compare(qc->query, true);
+				}
 
-					b.cv.notify_one();
+				try {
+					queue_conn->run("DELETE FROM Comparer.queue WHERE id = ? AND owner = ?", qc->id, qc->owner);
+				} catch (const exception& e) {
+					cerr << format("Unable to remove entry {} from Comparer.queue: {}\n", qc->id, e.what());
+					queue_conn.reset();
 				}
+			}
+		});
+	}
+}
 
-				if (rows_since_update > 1000) {
-					tds.run("UPDATE Comparer.log SET rows1=?, rows2=?, changed_rows=?, added_rows=?, removed_rows=?, bytes1=?, bytes2=?, end_date=SYSDATETIME() WHERE id=?",
-							num_rows1, num_rows2, changed_rows, added_rows, removed_rows, (int64_t)bytes1, (int64_t)bytes2, log_id);
+int main(int argc, char* argv[]) {
+	vector<pair<unsigned int, unsigned int>> ranges;
+	vector<unsigned int> ids;
+	string group;
+	unsigned int workers = 0, max_connections = 0, max_bcp_writers = 0;
+	bool service = false, setup = false;
+	int first_option = 1;
 
-					rows_since_update = 0;
-				} else
-					rows_since_update++;
+	if (argc < 2) {
+		cerr << "Usage: comparer.exe <query number>|<list of numbers and ranges>|--group=<name>|--service|--setup [--poll-interval=<seconds>] [--workers=<n>] [--max-connections=<n>] [--max-bcp-writers=<n>] [--parallel=<ranges>] [--checksum] [--incremental] [--two-phase] [--memory=<MB>] [--bcp-writers=<n>] [--staging] [--stats-json=<file>] [--file1=<file>] [--file2=<file>] [--save-snapshot=<file>] [--unsorted] [--spill-dir=<dir>]" << endl;
+		return 1;
+	}
+
+	if (!string_view(argv[1]).starts_with("--")) {
+		if (!parse_ids(string_view(argv[1]), ranges))
+			return 1;
+
+		first_option = 2;
+	}
+
+	for (int i = first_option; i < argc; i++) {
+		auto sv = string_view(argv[i]);
+
+		if (sv.starts_with("--group="))
+			group = sv.substr(sv.find('=') + 1);
+		else if (sv == "--service")
+			service = true;
+		else if (sv == "--setup")
+			setup = true;
+		else if (sv.starts_with("--poll-interval=")) {
+			unsigned int secs;
+
+			if (!parse_number(sv.substr(sv.find('=') + 1), secs))
+				return 1;
+
+			if (secs == 0) {
+				cerr << "Poll interval must be at least 1 second." << endl;
+				return 1;
 			}
-		};
 
-		if (results_table.empty())
-			run.operator()<false>();
-		else
-			run.operator()<true>();
-	} catch (...) {
-		t1.finished = true;
-		t2.finished = true;
-		throw;
+			poll_interval = chrono::seconds{secs};
+		}
+		else if (sv.starts_with("--workers=")) {
+			if (!parse_number(sv.substr(sv.find('=') + 1), workers))
+				return 1;
+
+			if (workers == 0) {
+				cerr << "Number of workers must be at least 1." << endl;
+				return 1;
+			}
+		} else if (sv.starts_with("--max-connections=")) {
+			if (!parse_number(sv.substr(sv.find('=') + 1), max_connections))
+				return 1;
+
+			if (max_connections == 0) {
+				cerr << "Maximum connections must be at least 1." << endl;
+				return 1;
+			}
+		} else if (sv.starts_with("--max-bcp-writers=")) {
+			if (!parse_number(sv.substr(sv.find('=') + 1), max_bcp_writers))
+				return 1;
+
+			if (max_bcp_writers == 0) {
+				cerr << "Maximum bcp writers must be at least 1." << endl;
+				return 1;
+			}
+		} else if (sv.starts_with("--parallel=")) {
+			if (!parse_number(sv.substr(sv.find('=') + 1), parallel_ranges))
+				return 1;
+
+			if (parallel_ranges == 0) {
+				cerr << "Number of parallel ranges must be at least 1." << endl;
+				return 1;
+			}
+		} else if (sv.starts_with("--bcp-writers=")) {
+			if (!parse_number(sv.substr(sv.find('=') + 1), bcp_writers))
+				return 1;
+
+			if (bcp_writers == 0) {
+				cerr << "Number of bcp writers must be at least 1." << endl;
+				return 1;
+			}
+		} else if (sv.starts_with("--memory=")) {
+			size_t mb;
+
+			if (!parse_number(sv.substr(sv.find('=') + 1), mb))
+				return 1;
+
+			if (mb == 0) {
+				cerr << "Memory budget must be at least 1 MB." << endl;
+				return 1;
+			}
+
+			mem_budget.limit = mb * 1048576;
+		} else if (sv.starts_with("--stats-json="))
+			stats_json = sv.substr(sv.find('=') + 1);
+		else if (sv.starts_with("--file1="))
+			file1 = sv.substr(sv.find('=') + 1);
+		else if (sv.starts_with("--file2="))
+			file2 = sv.substr(sv.find('=') + 1);
+		else if (sv.starts_with("--save-snapshot="))
+			save_snapshot = sv.substr(sv.find('=') + 1);
+		else if (sv.starts_with("--spill-dir="))
+			spill_dir = sv.substr(sv.find('=') + 1);
+		else if (sv == "--unsorted")
+			unsorted_mode = true;
+		else if (sv == "--checksum")
+			checksum_mode = true;
+		else if (sv == "--incremental")
+			incremental_mode = true;
+		else if (sv == "--two-phase")
+			two_phase_mode = true;
+		else if (sv == "--staging")
+			staging_mode = true;
+		else {
+			cerr << format("Unrecognized option \"{}\".\n", sv);
+			return 1;
+		}
 	}
 
-	b.t.request_stop();
-	b.t.join();
+	// these all work by adding predicates to the queries, which a file can't take
 
-	if (b.exc)
-		rethrow_exception(b.exc);
+	if ((!file1.empty() || !file2.empty() || !save_snapshot.empty()) &&
+		(parallel_ranges > 1 || checksum_mode || incremental_mode || two_phase_mode)) {
+		cerr << "--file1, --file2 and --save-snapshot can't be used with --parallel, --checksum, --incremental or --two-phase." << endl;
+		return 1;
+	}
 
-	tds.run("UPDATE Comparer.log SET success=1, rows1=?, rows2=?, changed_rows=?, added_rows=?, removed_rows=?, bytes1=?, bytes2=?, end_date=SYSDATETIME(), error=NULL WHERE id=?",
-			num_rows1, num_rows2, changed_rows, added_rows, removed_rows, (int64_t)bytes1, (int64_t)bytes2, log_id);
-}
+	// a snapshot has to be in key order, and the others all need sorted streams
 
-int main(int argc, char* argv[]) {
-	unsigned int num;
+	if (unsorted_mode && (!save_snapshot.empty() || parallel_ranges > 1 || checksum_mode || incremental_mode || two_phase_mode)) {
+		cerr << "--unsorted can't be used with --save-snapshot, --parallel, --checksum, --incremental or --two-phase." << endl;
+		return 1;
+	}
 
-	if (argc < 2) {
-		cerr << "Usage: comparer.exe <query number>" << endl;
+	if ((!ranges.empty()) + (!group.empty()) + service + setup != 1) {
+		cerr << "One of query numbers, --group, --service or --setup needs to be given." << endl;
 		return 1;
 	}
 
-	auto sv = string_view(argv[1]);
+	bool batch = service || !group.empty() || ranges.size() > 1 ||
+				 (ranges.size() == 1 && ranges.front().first != ranges.front().second);
 
-	auto [ptr, ec] = from_chars(sv.data(), sv.data() + sv.length(), num);
+	// these are all for one compare
 
-	if (ec != errc()) {
-		cerr << format("Could not convert \"{}\" to integer.\n", sv);
+	if (batch && (!file1.empty() || !file2.empty() || !save_snapshot.empty() || !stats_json.empty())) {
+		cerr << "--file1, --file2, --save-snapshot and --stats-json can't be used with more than one query." << endl;
 		return 1;
 	}
 
+	server_connections.limit = max_connections;
+
+	if (max_bcp_writers != 0)
+		bcp_slots = make_unique<counting_semaphore<>>(max_bcp_writers);
+
 	try {
+		if (spill_dir.empty())
+			spill_dir = filesystem::temp_directory_path();
+
 		auto db_server_env = getenv("DB_RMTSERVER");
 
 		if (!db_server_env)
@@ -1133,22 +2685,35 @@ int main(int argc, char* argv[]) {
 		if (db_password_env)
 			db_password = db_password_env;
 
-		do_compare(num);
+		if (setup) {
+			setup_schema();
+			return 0;
+		}
+
+		if (service) {
+			connections.enabled = true;
+			batch_workers = workers != 0 ? workers : DEFAULT_WORKERS;
+		} else if (batch) {
+			ids = plan_batch(ranges, group);
+			batch_workers = (unsigned int)min<size_t>(workers != 0 ? workers : DEFAULT_WORKERS, ids.size());
+		}
 	} catch (const exception& e) {
 		cerr << "Exception: " << e.what() << endl;
+		return 1;
+	}
 
+	if (service) {
 		try {
-			tds::tds tds(db_server, db_username, db_password, DB_APP);
-
-			if (log_id == 0)
-				tds.run("INSERT INTO Comparer.log(query, success, error) VALUES(?, 0, ?)", num, e.what());
-			else
-				tds.run("UPDATE Comparer.log SET error=?, end_date=GETDATE() WHERE id=?", e.what(), log_id);
-		} catch (...) {
+			run_service();
+		} catch (const exception& e) {
+			cerr << "Exception: " << e.what() << endl;
 		}
 
 		return 1;
 	}
 
-	return 0;
+	if (!batch)
+		return run_compare(ranges.front().first, false) ? 0 : 1;
+
+	return run_batch(ids) ? 0 : 1;
 }
@@ -13,6 +13,14 @@
 #include <mutex>
 #include <condition_variable>
 #include <format>
+#include <atomic>
+#include <span>
+#include <optional>
+#include <chrono>
+#include <compare>
+#include <filesystem>
+#include <fstream>
+#include <array>
 
 class formatted_error : public std::exception {
 public:
@@ -28,24 +36,6 @@ private:
 	std::string msg;
 };
 
-class sql_thread {
-public:
-	sql_thread(std::u16string_view query, std::unique_ptr<tds::tds>& tds);
-	~sql_thread();
-	void run(std::stop_token) noexcept;
-	void wait_for(const std::invocable auto& func);
-
-	bool finished;
-	std::u16string query;
-	std::unique_ptr<tds::tds> uptds;
-	std::exception_ptr ex;
-	std::vector<tds::column> cols;
-	std::list<std::vector<std::pair<tds::value_data_t, bool>>> results;
-	std::mutex lock;
-	std::condition_variable cv;
-	std::jthread t;
-};
-
 #ifdef _WIN32
 
 class handle_closer {
@@ -174,6 +164,347 @@ private:
 
 #endif
 
+class memory_budget;
+
+// Bytes counted against a memory_budget, which are given back when it's reset or destroyed.
+
+class budget_charge {
+public:
+	budget_charge() = default;
+	budget_charge(const budget_charge&) = delete;
+	budget_charge& operator=(const budget_charge&) = delete;
+
+	~budget_charge() {
+		reset();
+	}
+
+	void set(memory_budget& budget, size_t bytes);
+	void reset();
+
+private:
+	memory_budget* budget = nullptr;
+	size_t bytes = 0;
+};
+
+// A limit on the bytes held in fetched batches and queued differences, shared by all
+// the threads of the process.
+
+class memory_budget {
+public:
+	// Blocks until the bytes in use are under the limit, or pred returns true.
+
+	bool wait(std::stop_token stop, const std::invocable auto& pred) {
+		std::unique_lock ul(lock);
+
+		return cv.wait(ul, stop, [&]() {
+			return used < limit || pred();
+		});
+	}
+
+	void notify();
+
+	size_t in_use() {
+		std::lock_guard<std::mutex> lg(lock);
+
+		return used;
+	}
+
+	size_t limit = 1073741824; // 1 GB
+
+private:
+	friend class budget_charge;
+
+	std::mutex lock;
+	std::condition_variable_any cv;
+	size_t used = 0;
+};
+
+class column_batch {
+public:
+	void reset(bool fixed);
+	void add_value(const tds::value& v, size_t row);
+	void add_value(const column_batch& c, size_t row, size_t dest_row);
+	void add_value(std::span<const uint8_t> v, bool is_null, size_t row);
+	void seal() noexcept;
+
+	std::span<const uint8_t> value(size_t row) const noexcept {
+		if (fixed)
+			return std::span(data_ptr + (row * width), width);
+
+		return std::span(data_ptr + offsets_ptr[row], offsets_ptr[row + 1] - offsets_ptr[row]);
+	}
+
+	bool is_null(size_t row) const noexcept {
+		return (nulls_ptr[row / 64] >> (row % 64)) & 1;
+	}
+
+	bool fixed; // if true, every value is width bytes and nulls are zero-filled
+	size_t width;
+	std::vector<uint8_t> data;
+	std::vector<size_t> offsets; // only for variable-length columns
+	std::vector<uint64_t> nulls;
+
+	// What readers go through, which point either into the vectors once the batch has
+	// been sealed, or into a mapped snapshot.
+
+	const uint8_t* data_ptr = nullptr;
+	const size_t* offsets_ptr = nullptr;
+	const uint64_t* nulls_ptr = nullptr;
+};
+
+class row_batch {
+public:
+	void reset(const std::vector<bool>& fixed);
+	void add_row(tds::query& sq);
+	void add_row(std::span<const tds::column> row);
+	void add_row(const row_batch& src, size_t row);
+	bool full() const noexcept;
+	void seal() noexcept;
+
+	size_t num_rows = 0;
+	size_t bytes = 0;
+	std::vector<column_batch> columns;
+	budget_charge charge;
+	std::shared_ptr<const void> backing; // the mapping the columns point into, if any
+};
+
+// Batches of rows queued up by a producer thread for the merge to read.
+
+class batch_queue {
+public:
+	batch_queue();
+	bool reserve(std::stop_token stop, std::list<std::shared_ptr<row_batch>>& l);
+	void submit(std::list<std::shared_ptr<row_batch>>& l);
+	void finish() noexcept;
+	void wait_for(const std::invocable auto& func);
+
+	std::atomic<bool> finished;
+	std::exception_ptr ex;
+	std::vector<tds::column> cols;
+	std::list<std::shared_ptr<row_batch>> results;
+	std::list<std::shared_ptr<row_batch>> spare;
+	std::atomic<size_t> queued = 0; // number of batches in results
+	std::atomic<size_t> window; // how many batches the producer may queue
+	std::atomic<uint64_t> fetch_ns = 0; // waiting for the server
+	std::atomic<uint64_t> blocked_ns = 0; // held back by the window or the memory budget
+	std::atomic<uint64_t> starved_ns = 0; // the merge waiting for us
+	std::mutex lock;
+	std::condition_variable cv;
+};
+
+// An ordered stream of rows, which sql_thread reads into batches.
+
+class row_source {
+public:
+	virtual ~row_source() = default;
+
+	// Starts the stream, and returns the types and names of its columns.
+
+	virtual std::vector<tds::column> open() = 0;
+
+	// Moves on to the next row, waiting for it if need be. Returns false at the end.
+
+	virtual bool fetch_row() = 0;
+
+	// Like fetch_row, but returns false if the next row isn't available yet.
+
+	virtual bool fetch_row_no_wait() {
+		return fetch_row();
+	}
+
+	virtual void add_row(row_batch& b) = 0;
+
+	// Reads the current row, and any after it which are ready, into b. A source which
+	// has its rows in batches already can override this, and have fetch_row move a
+	// batch at a time.
+
+	virtual void read_batch(row_batch& b) {
+		do {
+			add_row(b);
+		} while (!b.full() && fetch_row_no_wait());
+
+		b.seal();
+	}
+
+	// Lets go of anything the stream is still holding on to.
+
+	virtual void close() noexcept {
+	}
+};
+
+class tds_source : public row_source {
+public:
+	tds_source(tds::tds& tds, std::u16string_view query) : tds(tds), query(query) {
+	}
+
+	std::vector<tds::column> open() override;
+	bool fetch_row() override;
+	bool fetch_row_no_wait() override;
+	void add_row(row_batch& b) override;
+	void close() noexcept override;
+
+private:
+	tds::tds& tds;
+	std::u16string query;
+	std::optional<tds::query> sq;
+};
+
+// A CSV file, whose first line gives the columns as SQL declarations, e.g.
+// "id int,name nvarchar(50)". An empty field is NULL, and "" is an empty string.
+
+class csv_source : public row_source {
+public:
+	csv_source(const std::filesystem::path& fn);
+
+	std::vector<tds::column> open() override;
+	bool fetch_row() override;
+	void add_row(row_batch& b) override;
+	void close() noexcept override;
+
+private:
+	bool read_record();
+
+	std::filesystem::path fn;
+	std::vector<char> buf; // has to outlive f
+	std::ifstream f;
+	uint64_t line = 1;
+	std::vector<std::string> fields;
+	std::vector<bool> quoted;
+	std::vector<tds::column> row;
+};
+
+// The binary format is a header giving the number of columns and each column's type,
+// followed by the rows, with each value as a little-endian uint32 length (0xffffffff
+// for NULL) and then its bytes as TDS would send them.
+
+class binary_source : public row_source {
+public:
+	binary_source(const std::filesystem::path& fn);
+
+	std::vector<tds::column> open() override;
+	bool fetch_row() override;
+	void add_row(row_batch& b) override;
+	void close() noexcept override;
+
+private:
+	std::filesystem::path fn;
+	std::vector<char> buf; // has to outlive f
+	std::ifstream f;
+	std::vector<tds::column> row;
+};
+
+class binary_writer {
+public:
+	binary_writer(const std::filesystem::path& fn, std::span<const tds::column> cols);
+	void write_row(std::span<const tds::column> row);
+
+private:
+	std::vector<char> buf; // has to outlive f
+	std::ofstream f;
+};
+
+// A whole file mapped read-only into memory.
+
+class mapped_file {
+public:
+	mapped_file(const std::filesystem::path& fn);
+	~mapped_file();
+
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	std::span<const uint8_t> data() const noexcept {
+		return std::span(ptr, size);
+	}
+
+private:
+	unique_handle h;
+#ifdef _WIN32
+	unique_handle mapping;
+#endif
+	const uint8_t* ptr = nullptr;
+	size_t size = 0;
+};
+
+// Writes an ordered stream to a snapshot file, a batch at a time as blocks of columns,
+// which snapshot_source can map straight back into batches without copying anything.
+// The file is written under a temporary name, and only renamed once it's finished.
+
+class snapshot_writer {
+public:
+	snapshot_writer(const std::filesystem::path& fn);
+	~snapshot_writer();
+	void start(std::span<const tds::column> cols);
+	void write_batch(const row_batch& b);
+	void finish();
+
+private:
+	void pad();
+
+	std::filesystem::path fn, tmp;
+	std::vector<char> buf; // has to outlive f
+	std::ofstream f;
+	uint64_t pos = 0;
+	std::vector<std::array<uint64_t, 2>> index; // offset and number of rows of each block
+	bool finished = false;
+};
+
+class snapshot_source : public row_source {
+public:
+	snapshot_source(const std::filesystem::path& fn) : fn(fn) {
+	}
+
+	std::vector<tds::column> open() override;
+	bool fetch_row() override;
+	void add_row(row_batch& b) override;
+	void read_batch(row_batch& b) override;
+
+private:
+	std::filesystem::path fn;
+	std::shared_ptr<mapped_file> file;
+	std::span<const uint8_t> blocks; // the index
+	size_t num_cols = 0;
+	size_t next_block = 0;
+	size_t block = 0;
+};
+
+// One partition of an unsorted compare, handed back in key order.
+
+class partition_source : public row_source {
+public:
+	partition_source(std::vector<tds::column> cols, std::vector<std::shared_ptr<row_batch>> batches,
+					 std::vector<std::pair<uint32_t, uint32_t>> order) :
+		cols(std::move(cols)), batches(std::move(batches)), order(std::move(order)) {
+	}
+
+	std::vector<tds::column> open() override;
+	bool fetch_row() override;
+	void add_row(row_batch& b) override;
+	void close() noexcept override;
+
+	std::vector<tds::column> cols;
+	std::vector<std::shared_ptr<row_batch>> batches;
+	std::vector<std::pair<uint32_t, uint32_t>> order; // batch and row of each row, sorted
+	size_t next_row = 0;
+	size_t current;
+};
+
+std::unique_ptr<row_source> open_file_source(const std::filesystem::path& fn);
+
+class sql_thread : public batch_queue {
+public:
+	sql_thread(std::u16string_view query, std::unique_ptr<tds::tds>& tds, snapshot_writer* tee = nullptr);
+	sql_thread(std::unique_ptr<row_source> source, snapshot_writer* tee = nullptr, unsigned int check_keys = 0);
+	~sql_thread();
+	void run(std::stop_token) noexcept;
+
+	std::unique_ptr<tds::tds> uptds; // if reading a query, the connection it's run on
+	std::unique_ptr<row_source> source;
+	snapshot_writer* tee; // if the stream is also being saved as a snapshot
+	unsigned int check_keys = 0; // if not 0, the number of key columns which must be strictly increasing
+	std::jthread t;
+};
+
 struct pk_col {
 	std::u16string name;
 	std::u16string type;
@@ -181,29 +512,228 @@ struct pk_col {
 	bool nullable;
 };
 
-class bcp_thread {
+struct table_queries {
+	std::u16string q1, q2;
+	std::u16string from1, from2;
+	std::u16string order_by;
+	std::vector<std::u16string> cols;
+	std::string server1, server2;
+	unsigned int pk_columns = 0;
+	std::vector<pk_col> pk;
+	bool pk_only = false;
+};
+
+struct compare_stats {
+	std::atomic<unsigned int> rows1 = 0, rows2 = 0, changed_rows = 0, added_rows = 0, removed_rows = 0;
+	std::atomic<size_t> bytes1 = 0, bytes2 = 0;
+	std::atomic<uint64_t> merge_ns = 0, send_wait_ns = 0;
+};
+
+enum class diff_change : uint8_t {
+	added,
+	removed,
+	modified
+};
+
+// A value copied into a diff_arena, or for large values, borrowed from the row_batch it
+// was read into.
+
+struct diff_value {
+	size_t offset;
+	size_t length;
+	bool is_null;
+	const uint8_t* borrowed = nullptr;
+};
+
+struct diff_record {
+	size_t key; // index of the row's first value in diff_arena::keys
+	diff_change change;
+	uint16_t col;
+	diff_value value1, value2;
+};
+
+// Types and names of the values in a range's diff records, shared by all its arenas.
+
+struct diff_schema {
+	tds::value num;
+	bool pk_only;
+	std::vector<tds::value> keys; // for the old results table, the primary key string
+	std::vector<tds::value> cols1, cols2;
+	std::vector<tds::value> col_nums, names;
+};
+
+// Differences get written into an arena, which is handed to the bcp thread as a whole
+// and then reused, so that adding a record doesn't normally need to allocate anything.
+
+class diff_arena {
 public:
-	bcp_thread(std::u16string_view table_name, const std::vector<pk_col>& pk, bool pk_only) : table_name(table_name), pk_only(pk_only) {
-		this->pk.reserve(pk.size());
+	void reset(const std::shared_ptr<const diff_schema>& schema);
+	diff_value add_value(std::span<const uint8_t> v, bool is_null = false);
+	diff_value add_value(const column_batch& c, size_t row);
+	diff_value add_value(const std::shared_ptr<row_batch>& b, uint16_t col, size_t row);
+	size_t add_key(const row_batch& b, size_t row, unsigned int columns);
+	size_t add_key(std::string_view pk);
+	void add(size_t key, diff_change change, uint16_t col, const diff_value& value1, const diff_value& value2);
+	bool full() const noexcept;
+
+	size_t memory() const noexcept {
+		return data.size() + (keys.size() * sizeof(diff_value)) + (records.size() * sizeof(diff_record));
+	}
 
-		for (const auto& p : pk) {
-			this->pk.emplace_back(p.name);
+	std::span<const uint8_t> bytes(const diff_value& v) const noexcept {
+		if (v.borrowed)
+			return std::span(v.borrowed, v.length);
+
+		return std::span(data.data() + v.offset, v.length);
+	}
+
+	std::shared_ptr<const diff_schema> schema;
+	std::vector<uint8_t> data;
+	std::vector<diff_value> keys;
+	std::vector<diff_record> records;
+	std::vector<std::shared_ptr<const row_batch>> pinned; // batches that values are borrowed from
+	size_t pinned_bytes = 0;
+	budget_charge charge;
+};
+
+// Reads a batch_queue a row at a time, handing batches back to the producer once
+// they're finished with.
+
+class batch_cursor {
+public:
+	batch_cursor(batch_queue& t) noexcept : t(t) {
+	}
+
+	bool next_batch();
+	const tds::column& load(size_t r, uint16_t col);
+
+	const row_batch& batch() const noexcept {
+		return *batches.front();
+	}
+
+	const std::shared_ptr<row_batch>& batch_ptr() const noexcept {
+		return batches.front();
+	}
+
+	batch_queue& t;
+	std::list<std::shared_ptr<row_batch>> batches;
+	size_t row = 0;
+	bool finished = false;
+	bool done = false;
+};
+
+// Takes full diff_arenas from the compare threads and writes them out on one or more
+// writer threads. Derived classes say what writing an arena means.
+
+class diff_sink {
+public:
+	diff_sink(bool held = false) : held(held) {
+	}
+
+	virtual ~diff_sink() = default;
+
+	// Lets the writers start, if they were created held.
+
+	void release() {
+		{
+			std::lock_guard<std::mutex> lg(lock);
+
+			held = false;
 		}
 
-		t = std::jthread([this](std::stop_token stop) noexcept {
-			this->run(stop);
-		});
+		cv.notify_all();
 	}
 
-	std::list<std::vector<tds::value>> res;
+	void fail(std::exception_ptr e) noexcept;
+
+	// Waits for the writers to empty the queue, and then stops them.
+
+	void join() {
+		for (auto& t : threads) {
+			t.request_stop();
+		}
+
+		for (auto& t : threads) {
+			if (t.joinable())
+				t.join();
+		}
+	}
+
+	std::list<diff_arena> res, spare;
+	std::atomic<size_t> queued = 0; // arenas not yet written
+	std::atomic<uint64_t> write_ns = 0, rows_written = 0;
 	std::condition_variable_any cv;
 	std::mutex lock;
 	std::exception_ptr exc;
-	std::jthread t;
+	bool held;
+	std::vector<std::jthread> threads;
+
+protected:
+	// Called once on each writer thread, so that it can set up anything it needs (such
+	// as a connection), returning the function that writes an arena.
+
+	virtual std::function<void(diff_arena&)> writer() = 0;
+
+	// Has to be called by the derived class's constructor rather than ours, as writer()
+	// can't be called until it's been constructed. Its destructor has to call join().
+
+	void start(unsigned int writers);
+
+private:
+	void run(std::stop_token stop) noexcept;
+};
+
+class bcp_thread : public diff_sink {
+public:
+	bcp_thread(std::u16string_view table_name, const std::vector<pk_col>& pk, bool pk_only, unsigned int writers = 1,
+			   std::u16string_view legacy_table = u"Comparer.results", bool held = false) :
+			   diff_sink(held), table_name(table_name), legacy_table(legacy_table), pk_only(pk_only) {
+		this->pk.reserve(pk.size());
+
+		for (const auto& p : pk) {
+			this->pk.emplace_back(p.name);
+		}
+
+		// each writer has its own connection, and takes an arena at a time off the queue
+
+		start(writers);
+	}
+
+	~bcp_thread() {
+		join();
+	}
+
 	std::u16string table_name;
+	std::u16string legacy_table; // if table_name is empty
 	std::vector<std::u16string> pk;
 	bool pk_only;
 
-private:
-	void run(std::stop_token stop) noexcept;
+protected:
+	std::function<void(diff_arena&)> writer() override;
 };
+
+extern memory_budget mem_budget;
+
+uint64_t elapsed_ns(std::chrono::steady_clock::time_point start);
+std::optional<tds::sql_type> fixed_width_type(const tds::value& v);
+bool is_int_type(const std::optional<tds::sql_type>& t) noexcept;
+int64_t read_int(std::span<const uint8_t> sp) noexcept;
+uint64_t hash_row(const row_batch& b, size_t row, const std::vector<bool>& int_cols) noexcept;
+std::weak_ordering compare_keys(batch_cursor& s1, batch_cursor& s2, const std::vector<bool>& int_keys,
+								unsigned int columns);
+std::weak_ordering compare_row_keys(const row_batch& b1, size_t r1, const row_batch& b2, size_t r2,
+									const std::vector<bool>& int_keys, std::vector<tds::column>& scratch1,
+									std::vector<tds::column>& scratch2);
+void diff_row(std::vector<tds::value>& row, const diff_arena& a, const diff_record& r, bool legacy);
+
+// multiset is for the unsorted compare of a table without a key, where rows are named by
+// a hash of the row rather than numbered.
+
+template<bool do_new>
+void compare_range(batch_queue& t1, batch_queue& t2, diff_sink& b, compare_stats& stats,
+				   unsigned int num, unsigned int pk_columns, bool pk_only, bool multiset = false);
+
+template<bool do_new>
+void compare_unsorted(batch_queue& t1, batch_queue& t2, diff_sink& b, compare_stats& stats,
+					  unsigned int num, unsigned int pk_columns, bool pk_only, const std::filesystem::path& spill_dir,
+					  size_t memory);
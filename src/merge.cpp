@@ -0,0 +1,1482 @@
+#include "comparer.h"
+#include <optional>
+#include <array>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+static constexpr size_t BATCH_ROWS = 1000;
+static constexpr size_t BATCH_BYTES = 1048576; // 1 MB
+static constexpr size_t MIN_WINDOW = 2;
+static constexpr size_t MAX_WINDOW = 1024;
+static constexpr size_t DIFF_ARENA_RECORDS = 10000;
+static constexpr size_t DIFF_ARENA_BYTES = 1048576; // 1 MB
+static constexpr size_t DIFF_ARENA_PINNED_BYTES = 16777216; // 16 MB
+static constexpr size_t BORROW_BYTES = 8192;
+
+memory_budget mem_budget;
+
+void budget_charge::set(memory_budget& budget, size_t bytes) {
+	reset();
+
+	{
+		lock_guard<mutex> lg(budget.lock);
+
+		budget.used += bytes;
+	}
+
+	this->budget = &budget;
+	this->bytes = bytes;
+}
+
+void budget_charge::reset() {
+	if (!budget)
+		return;
+
+	{
+		lock_guard<mutex> lg(budget->lock);
+
+		budget->used -= bytes;
+	}
+
+	budget->cv.notify_all();
+
+	budget = nullptr;
+	bytes = 0;
+}
+
+void memory_budget::notify() {
+	{
+		lock_guard<mutex> lg(lock);
+	}
+
+	cv.notify_all();
+}
+
+uint64_t elapsed_ns(chrono::steady_clock::time_point start) {
+	return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+// Returns the type of a column whose values are always the same number of bytes,
+// with the nullable TDS types mapped to their NOT NULL equivalents.
+
+optional<tds::sql_type> fixed_width_type(const tds::value& v) {
+	switch (v.type) {
+		case tds::sql_type::INTN:
+			switch (v.max_length) {
+				case 1:
+					return tds::sql_type::TINYINT;
+				case 2:
+					return tds::sql_type::SMALLINT;
+				case 4:
+					return tds::sql_type::INT;
+				case 8:
+					return tds::sql_type::BIGINT;
+				default:
+					return nullopt;
+			}
+
+		case tds::sql_type::FLTN:
+			return v.max_length == 4 ? tds::sql_type::REAL : tds::sql_type::FLOAT;
+
+		case tds::sql_type::BITN:
+			return tds::sql_type::BIT;
+
+		case tds::sql_type::MONEYN:
+			return v.max_length == 4 ? tds::sql_type::SMALLMONEY : tds::sql_type::MONEY;
+
+		case tds::sql_type::DATETIMN:
+			return v.max_length == 4 ? tds::sql_type::DATETIM4 : tds::sql_type::DATETIME;
+
+		case tds::sql_type::NUMERIC:
+			return tds::sql_type::DECIMAL;
+
+		case tds::sql_type::TINYINT:
+		case tds::sql_type::SMALLINT:
+		case tds::sql_type::INT:
+		case tds::sql_type::BIGINT:
+		case tds::sql_type::REAL:
+		case tds::sql_type::FLOAT:
+		case tds::sql_type::BIT:
+		case tds::sql_type::SMALLMONEY:
+		case tds::sql_type::MONEY:
+		case tds::sql_type::DATETIM4:
+		case tds::sql_type::DATETIME:
+		case tds::sql_type::DATE:
+		case tds::sql_type::TIME:
+		case tds::sql_type::DATETIME2:
+		case tds::sql_type::DATETIMEOFFSET:
+		case tds::sql_type::DECIMAL:
+		case tds::sql_type::UNIQUEIDENTIFIER:
+			return v.type;
+
+		default:
+			return nullopt;
+	}
+}
+
+void column_batch::reset(bool fixed) {
+	this->fixed = fixed;
+	width = 0;
+
+	// clear() keeps the capacity, so a recycled batch doesn't need to allocate
+
+	data.clear();
+	offsets.clear();
+	nulls.clear();
+	data_ptr = nullptr;
+	offsets_ptr = nullptr;
+	nulls_ptr = nullptr;
+
+	if (!fixed)
+		offsets.push_back(0);
+}
+
+void column_batch::add_value(const tds::value& v, size_t row) {
+	add_value(span(v.val.data(), v.val.size()), v.is_null, row);
+}
+
+void column_batch::add_value(const column_batch& c, size_t row, size_t dest_row) {
+	if (c.is_null(row))
+		add_value({}, true, dest_row);
+	else
+		add_value(c.value(row), false, dest_row);
+}
+
+void column_batch::add_value(span<const uint8_t> v, bool is_null, size_t row) {
+	if (row % 64 == 0)
+		nulls.push_back(0);
+
+	if (is_null)
+		nulls.back() |= (uint64_t)1 << (row % 64);
+	else if (fixed) {
+		if (width == 0) {
+			// width comes from the first non-null value, so backfill any nulls before it
+			width = v.size();
+			data.resize(row * width);
+		} else if (v.size() != width) {
+			// shouldn't happen, but fall back to offsets rather than fail
+			offsets.resize(row + 1);
+
+			for (size_t i = 0; i <= row; i++) {
+				offsets[i] = i * width;
+			}
+
+			fixed = false;
+		}
+	}
+
+	if (fixed) {
+		if (is_null)
+			data.resize(data.size() + width);
+		else
+			data.insert(data.end(), v.begin(), v.end());
+	} else {
+		if (!is_null)
+			data.insert(data.end(), v.begin(), v.end());
+
+		offsets.push_back(data.size());
+	}
+}
+
+void column_batch::seal() noexcept {
+	data_ptr = data.data();
+	offsets_ptr = offsets.data();
+	nulls_ptr = nulls.data();
+}
+
+void row_batch::reset(const vector<bool>& fixed) {
+	num_rows = 0;
+	bytes = 0;
+	backing.reset();
+
+	columns.resize(fixed.size());
+
+	for (size_t i = 0; i < fixed.size(); i++) {
+		columns[i].reset(fixed[i]);
+	}
+}
+
+void row_batch::add_row(tds::query& sq) {
+	for (uint16_t i = 0; i < columns.size(); i++) {
+		const auto& col = sq[i];
+
+		columns[i].add_value(col, num_rows);
+
+		if (!col.is_null)
+			bytes += col.val.size();
+	}
+
+	num_rows++;
+}
+
+void row_batch::add_row(span<const tds::column> row) {
+	for (uint16_t i = 0; i < columns.size(); i++) {
+		const auto& col = row[i];
+
+		columns[i].add_value(col, num_rows);
+
+		if (!col.is_null)
+			bytes += col.val.size();
+	}
+
+	num_rows++;
+}
+
+void row_batch::add_row(const row_batch& src, size_t row) {
+	for (size_t i = 0; i < columns.size(); i++) {
+		const auto& c = src.columns[i];
+
+		columns[i].add_value(c, row, num_rows);
+
+		if (!c.is_null(row))
+			bytes += c.value(row).size();
+	}
+
+	num_rows++;
+}
+
+bool row_batch::full() const noexcept {
+	return num_rows >= BATCH_ROWS || bytes >= BATCH_BYTES;
+}
+
+// Has to be called once the batch has been filled, before anything reads it.
+
+void row_batch::seal() noexcept {
+	for (auto& c : columns) {
+		c.seal();
+	}
+}
+
+batch_queue::batch_queue() : finished(false), window(MIN_WINDOW) {
+}
+
+// Waits until the producer is allowed to fill another batch, and moves one into l for
+// it. Returns false if it's been told to stop.
+
+bool batch_queue::reserve(stop_token stop, list<shared_ptr<row_batch>>& l) {
+	auto start = chrono::steady_clock::now();
+
+	// stay within the window the merge has given us...
+
+	{
+		unique_lock ul(lock);
+
+		cv.wait(ul, [&]() { return queued < window || finished || stop.stop_requested(); });
+	}
+
+	// ... and hold back while over the memory budget, unless the merge has nothing left of ours to read
+
+	mem_budget.wait(stop, [&]() noexcept {
+		return queued == 0 || finished;
+	});
+
+	blocked_ns += elapsed_ns(start);
+
+	{
+		lock_guard<mutex> guard(lock);
+
+		if (finished || stop.stop_requested())
+			return false;
+
+		if (!spare.empty())
+			l.splice(l.end(), spare, spare.begin());
+	}
+
+	if (l.empty())
+		l.push_back(make_shared<row_batch>());
+
+	return true;
+}
+
+// Queues the batch in l for the merge.
+
+void batch_queue::submit(list<shared_ptr<row_batch>>& l) {
+	l.front()->charge.set(mem_budget, l.front()->bytes);
+
+	{
+		lock_guard<mutex> guard(lock);
+
+		results.splice(results.end(), l);
+		queued++;
+	}
+
+	cv.notify_all();
+}
+
+void batch_queue::finish() noexcept {
+	finished = true;
+
+	lock_guard<mutex> guard(lock);
+	cv.notify_all();
+}
+
+void batch_queue::wait_for(const invocable auto& func) {
+	unique_lock<mutex> ul(lock);
+
+	cv.wait(ul, [&]() {
+		return finished || !results.empty();
+	});
+
+	func();
+}
+
+static string make_pk_string(const vector<tds::column>& row, unsigned int pk_columns) {
+	string ret;
+
+	for (unsigned int i = 0; i < pk_columns; i++) {
+		if (i != 0)
+			ret += ",";
+
+		ret += (string)row[i];
+	}
+
+	return ret;
+}
+
+static string pseudo_pk(unsigned int& rownum) {
+	auto s = format("{}", rownum);
+
+	rownum++;
+
+	return s;
+}
+
+// In a multiset compare a row without a key is named by a hash of the whole row instead,
+// so that it gets the same name from one run to the next whatever else has changed.
+// Identical rows are next to each other, so repeats are numbered.
+
+static string pseudo_pk(uint64_t hash, uint64_t& last_hash, unsigned int& repeat) {
+	if (repeat != 0 && hash == last_hash)
+		repeat++;
+	else {
+		last_hash = hash;
+		repeat = 1;
+	}
+
+	if (repeat == 1)
+		return format("{:016x}", hash);
+
+	return format("{:016x}-{}", hash, repeat);
+}
+
+void diff_arena::reset(const shared_ptr<const diff_schema>& schema) {
+	this->schema = schema;
+
+	data.clear();
+	keys.clear();
+	records.clear();
+	pinned.clear();
+	pinned_bytes = 0;
+	charge.reset();
+}
+
+diff_value diff_arena::add_value(span<const uint8_t> v, bool is_null) {
+	diff_value dv{data.size(), v.size(), is_null};
+
+	data.insert(data.end(), v.begin(), v.end());
+
+	return dv;
+}
+
+diff_value diff_arena::add_value(const column_batch& c, size_t row) {
+	if (c.is_null(row))
+		return {0, 0, true};
+
+	return add_value(c.value(row));
+}
+
+// Values big enough that copying them would matter point into the batch instead, which
+// the arena keeps a reference to until the bcp thread has written it.
+
+diff_value diff_arena::add_value(const shared_ptr<row_batch>& b, uint16_t col, size_t row) {
+	const auto& c = b->columns[col];
+
+	if (c.is_null(row))
+		return {0, 0, true};
+
+	auto v = c.value(row);
+
+	if (v.size() < BORROW_BYTES)
+		return add_value(v);
+
+	if (pinned.empty() || pinned.back() != b) {
+		pinned.push_back(b);
+		pinned_bytes += b->bytes;
+	}
+
+	return {0, v.size(), false, v.data()};
+}
+
+size_t diff_arena::add_key(const row_batch& b, size_t row, unsigned int columns) {
+	auto key = keys.size();
+
+	for (unsigned int i = 0; i < columns; i++) {
+		keys.push_back(add_value(b.columns[i], row));
+	}
+
+	return key;
+}
+
+size_t diff_arena::add_key(string_view pk) {
+	auto key = keys.size();
+
+	keys.push_back(add_value(span((const uint8_t*)pk.data(), pk.size())));
+
+	return key;
+}
+
+void diff_arena::add(size_t key, diff_change change, uint16_t col, const diff_value& value1, const diff_value& value2) {
+	records.push_back({key, change, col, value1, value2});
+}
+
+bool diff_arena::full() const noexcept {
+	return records.size() >= DIFF_ARENA_RECORDS || data.size() >= DIFF_ARENA_BYTES ||
+		   pinned_bytes >= DIFF_ARENA_PINNED_BYTES;
+}
+
+// Fills in a row for bcp from a diff record. The values are copied from templates,
+// so their buffers get reused rather than reallocated.
+
+void diff_row(vector<tds::value>& row, const diff_arena& a, const diff_record& r, bool legacy) {
+	static const array<tds::value, 3> changes{ tds::value("added"), tds::value("removed"), tds::value("modified") };
+	static const tds::value zero = (int32_t)0, null_value = nullptr;
+	const auto& s = *a.schema;
+	size_t n = 0;
+
+	auto copy = [&](const tds::value& v) {
+		row[n++] = v;
+	};
+
+	auto value = [&](const tds::value& type, const diff_value& v) {
+		auto& dest = row[n++];
+		auto sp = a.bytes(v);
+
+		dest = type;
+		dest.is_null = v.is_null;
+		dest.val.assign(sp.begin(), sp.end());
+	};
+
+	row.resize(legacy ? 7 : (s.keys.size() + (s.pk_only ? 1 : 5)));
+
+	if (legacy)
+		copy(s.num);
+
+	for (size_t i = 0; i < s.keys.size(); i++) {
+		value(s.keys[i], a.keys[r.key + i]);
+	}
+
+	copy(changes[(size_t)r.change]);
+
+	if (s.pk_only) {
+		if (legacy) {
+			copy(zero);
+			copy(null_value);
+			copy(null_value);
+			copy(null_value);
+		}
+
+		return;
+	}
+
+	copy(s.col_nums[r.col]);
+	value(s.cols1[r.col], r.value1);
+	value(s.cols2[r.col], r.value2);
+	copy(s.names[r.col]);
+}
+
+void diff_sink::start(unsigned int writers) {
+	for (unsigned int i = 0; i < writers; i++) {
+		threads.emplace_back([this](stop_token stop) noexcept {
+			this->run(stop);
+		});
+	}
+}
+
+void diff_sink::run(stop_token stop) noexcept {
+	try {
+		auto write = writer();
+
+		do {
+			decltype(res) local_res;
+
+			{
+				unique_lock ul(lock);
+
+				cv.wait(ul, stop, [&]{ return !held && !res.empty(); });
+
+				if (!held && !res.empty())
+					local_res.splice(local_res.end(), res, res.begin());
+			}
+
+			if (local_res.empty() && stop.stop_requested())
+				break;
+
+			for (auto& a : local_res) {
+				write(a);
+
+				// let go of any batches that values were borrowed from, and of the arena's
+				// share of the memory budget
+
+				a.pinned.clear();
+				a.pinned_bytes = 0;
+
+				queued--;
+				a.charge.reset();
+			}
+
+			// hand the arenas back to be reused
+
+			lock_guard<mutex> lg(lock);
+
+			spare.splice(spare.end(), local_res);
+		} while (true);
+	} catch (...) {
+		fail(current_exception());
+	}
+}
+
+void diff_sink::fail(exception_ptr e) noexcept {
+	// free up anything still queued, so the compare threads don't block on the budget
+
+	{
+		lock_guard<mutex> lg(lock);
+
+		if (!exc)
+			exc = e;
+
+		res.clear();
+		queued = 0;
+	}
+
+	mem_budget.notify();
+}
+
+// Hands the current batch back to the producer to be refilled, and waits for the
+// next one. Returns false once the stream has run out.
+
+bool batch_cursor::next_batch() {
+	if (!batches.empty()) {
+		// if a queued difference still points into the batch, it gets freed once that's been written
+
+		if (batches.front().use_count() == 1) {
+			atomic_thread_fence(memory_order_acquire);
+
+			batches.front()->charge.reset();
+
+			lock_guard<mutex> lg(t.lock);
+
+			t.spare.splice(t.spare.end(), batches, batches.begin());
+		} else
+			batches.pop_front();
+	}
+
+	row = 0;
+
+	while (batches.empty()) {
+		bool starved;
+
+		if (done) {
+			finished = true;
+			return false;
+		}
+
+		{
+			lock_guard<mutex> lg(t.lock);
+
+			starved = t.results.empty() && !t.finished;
+		}
+
+		auto start = chrono::steady_clock::now();
+
+		t.wait_for([&]() noexcept {
+			done = t.finished;
+
+			if (!t.results.empty()) {
+				// If we had to wait, let the producer get further ahead. If it filled
+				// its window, it's ahead of us, so close the window back up slowly.
+
+				if (starved)
+					t.window = min(t.window * 2, MAX_WINDOW);
+				else if (t.queued >= t.window && t.window > MIN_WINDOW)
+					t.window--;
+
+				batches.splice(batches.end(), t.results);
+				t.queued = 0;
+				t.cv.notify_all();
+			}
+		});
+
+		t.starved_ns += elapsed_ns(start);
+
+		mem_budget.notify(); // the producer may be waiting for its queue to empty
+
+		if (t.finished && t.ex)
+			rethrow_exception(t.ex);
+	}
+
+	return true;
+}
+
+// copies a value into the queue's column, so the generic tds::value code can use it
+
+const tds::column& batch_cursor::load(size_t r, uint16_t col) {
+	const auto& c = batches.front()->columns[col];
+	auto& dest = t.cols[col];
+
+	dest.is_null = c.is_null(r);
+
+	if (!dest.is_null) {
+		auto v = c.value(r);
+
+		dest.val.assign(v.begin(), v.end());
+	}
+
+	return dest;
+}
+
+int64_t read_int(span<const uint8_t> sp) noexcept {
+	switch (sp.size()) {
+		case 1:
+			return sp[0]; // TINYINT is unsigned
+
+		case 2: {
+			int16_t v;
+			memcpy(&v, sp.data(), sizeof(v));
+			return v;
+		}
+
+		case 4: {
+			int32_t v;
+			memcpy(&v, sp.data(), sizeof(v));
+			return v;
+		}
+
+		default: {
+			int64_t v;
+			memcpy(&v, sp.data(), sizeof(v));
+			return v;
+		}
+	}
+}
+
+// FNV-1a over the first int_cols.size() columns, with integers hashed by value so that
+// an INT matches a BIGINT
+
+uint64_t hash_row(const row_batch& b, size_t row, const vector<bool>& int_cols) noexcept {
+	uint64_t h = 0xcbf29ce484222325;
+
+	auto add = [&](const void* data, size_t len) noexcept {
+		auto p = (const uint8_t*)data;
+
+		for (size_t i = 0; i < len; i++) {
+			h ^= p[i];
+			h *= 0x100000001b3;
+		}
+	};
+
+	for (size_t i = 0; i < int_cols.size(); i++) {
+		const auto& c = b.columns[i];
+
+		if (c.is_null(row)) {
+			static const uint8_t null_marker = 0xff;
+
+			add(&null_marker, sizeof(null_marker));
+		} else if (int_cols[i]) {
+			auto v = read_int(c.value(row));
+
+			add(&v, sizeof(v));
+		} else {
+			auto v = c.value(row);
+			auto len = (uint64_t)v.size();
+
+			add(&len, sizeof(len));
+			add(v.data(), v.size());
+		}
+	}
+
+	return h;
+}
+
+bool is_int_type(const optional<tds::sql_type>& t) noexcept {
+	return t == tds::sql_type::TINYINT || t == tds::sql_type::SMALLINT ||
+		   t == tds::sql_type::INT || t == tds::sql_type::BIGINT;
+}
+
+// Returns true if equal values of the two columns will always have equal bytes.
+
+static bool bytes_comparable(const tds::column& c1, const tds::column& c2) {
+	auto t1 = fixed_width_type(c1);
+	auto t2 = fixed_width_type(c2);
+
+	if (!t1.has_value() || t1 != t2)
+		return false;
+
+	switch (*t1) {
+		case tds::sql_type::REAL:
+		case tds::sql_type::FLOAT:
+			return false; // compared with a tolerance
+
+		case tds::sql_type::DECIMAL:
+			return c1.precision == c2.precision && c1.scale == c2.scale;
+
+		case tds::sql_type::TIME:
+		case tds::sql_type::DATETIME2:
+		case tds::sql_type::DATETIMEOFFSET:
+			return c1.scale == c2.scale;
+
+		default:
+			return true;
+	}
+}
+
+weak_ordering compare_keys(batch_cursor& s1, batch_cursor& s2, const vector<bool>& int_keys, unsigned int columns) {
+	const auto& b1 = s1.batch();
+	const auto& b2 = s2.batch();
+
+	for (uint16_t i = 0; i < columns; i++) {
+		const auto& c1 = b1.columns[i];
+		const auto& c2 = b2.columns[i];
+		auto n1 = c1.is_null(s1.row);
+		auto n2 = c2.is_null(s2.row);
+
+		if (n1 || n2) {
+			if (n1 && n2)
+				continue;
+			else if (n1)
+				return weak_ordering::less;
+			else
+				return weak_ordering::greater;
+		}
+
+		if (int_keys[i]) {
+			auto ret = read_int(c1.value(s1.row)) <=> read_int(c2.value(s2.row));
+
+			if (ret != 0)
+				return ret;
+
+			continue;
+		}
+
+		auto ret = s1.load(s1.row, i) <=> s2.load(s2.row, i);
+
+		if (ret == partial_ordering::unordered)
+			throw runtime_error("Unexpected partial_ordering::unordered while comparing primary keys.");
+
+		if (ret == partial_ordering::less)
+			return weak_ordering::less;
+		else if (ret == partial_ordering::greater)
+			return weak_ordering::greater;
+	}
+
+	return weak_ordering::equivalent;
+}
+
+static const tds::column& load_value(tds::column& dest, const column_batch& c, size_t row) {
+	auto v = c.value(row);
+
+	dest.is_null = false;
+	dest.val.assign(v.begin(), v.end());
+
+	return dest;
+}
+
+// Like compare_keys, but for rows which aren't under a cursor, such as those being sorted
+// by an unsorted compare or checked for order as a file's read.
+
+weak_ordering compare_row_keys(const row_batch& b1, size_t r1, const row_batch& b2, size_t r2,
+							   const vector<bool>& int_keys, vector<tds::column>& scratch1,
+							   vector<tds::column>& scratch2) {
+	for (size_t i = 0; i < int_keys.size(); i++) {
+		const auto& c1 = b1.columns[i];
+		const auto& c2 = b2.columns[i];
+		auto n1 = c1.is_null(r1);
+		auto n2 = c2.is_null(r2);
+
+		if (n1 || n2) {
+			if (n1 && n2)
+				continue;
+			else if (n1)
+				return weak_ordering::less;
+			else
+				return weak_ordering::greater;
+		}
+
+		if (int_keys[i]) {
+			auto ret = read_int(c1.value(r1)) <=> read_int(c2.value(r2));
+
+			if (ret != 0)
+				return ret;
+
+			continue;
+		}
+
+		auto ret = load_value(scratch1[i], c1, r1) <=> load_value(scratch2[i], c2, r2);
+
+		if (ret == partial_ordering::unordered)
+			throw runtime_error("Unexpected partial_ordering::unordered while comparing primary keys.");
+
+		if (ret == partial_ordering::less)
+			return weak_ordering::less;
+		else if (ret == partial_ordering::greater)
+			return weak_ordering::greater;
+	}
+
+	return weak_ordering::equivalent;
+}
+
+// Compares the values of a fixed-width column for each pair of matched rows, adding
+// the index of any that differ to diffs. Nulls are zero-filled, so if the null bits
+// agree the bytes can be compared without looking at them again.
+
+template<size_t N>
+static void compare_fixed(const column_batch& c1, const column_batch& c2,
+						  span<const pair<size_t, size_t>> matches, vector<size_t>& diffs) {
+	auto width = N == 0 ? c1.width : N;
+	auto d1 = c1.data_ptr;
+	auto d2 = c2.data_ptr;
+
+	for (size_t j = 0; j < matches.size(); j++) {
+		auto [r1, r2] = matches[j];
+		auto n1 = c1.is_null(r1);
+
+		if (n1 != c2.is_null(r2) || (!n1 && memcmp(d1 + (r1 * width), d2 + (r2 * width), width)))
+			diffs.push_back(j);
+	}
+}
+
+// Calls eq for each pair of matched rows where neither value is null.
+
+static void compare_values(const column_batch& c1, const column_batch& c2, span<const pair<size_t, size_t>> matches,
+						   vector<size_t>& diffs, const invocable<span<const uint8_t>, span<const uint8_t>> auto& eq) {
+	for (size_t j = 0; j < matches.size(); j++) {
+		auto [r1, r2] = matches[j];
+		auto n1 = c1.is_null(r1);
+
+		if (n1 != c2.is_null(r2) || (!n1 && !eq(c1.value(r1), c2.value(r2))))
+			diffs.push_back(j);
+	}
+}
+
+// Floating-point values are allowed to be a few units in the last place apart, with
+// anything very close to zero treated as zero. FLOAT_ULPS is about 10 s.f.
+
+static constexpr uint64_t FLOAT_ULPS = 262144;
+static constexpr uint32_t REAL_ULPS = 2;
+
+template<typename T, typename I>
+static bool float_close(T f1, T f2, make_unsigned_t<I> ulps) noexcept {
+	I i1, i2;
+
+	if (f1 > -1.0e-10 && f1 < 1.0e-10)
+		f1 = 0.0;
+
+	if (f2 > -1.0e-10 && f2 < 1.0e-10)
+		f2 = 0.0;
+
+	memcpy(&i1, &f1, sizeof(I));
+	memcpy(&i2, &f2, sizeof(I));
+
+	// make the integers run in the same order as the values
+
+	if (i1 < 0)
+		i1 = numeric_limits<I>::min() - i1;
+
+	if (i2 < 0)
+		i2 = numeric_limits<I>::min() - i2;
+
+	if (i1 < i2)
+		swap(i1, i2);
+
+	return (make_unsigned_t<I>)i1 - (make_unsigned_t<I>)i2 < ulps;
+}
+
+// DECIMALs are a sign byte followed by the little-endian magnitude. If the scales differ,
+// the one with the larger scale is divided down, and has to leave no remainder.
+
+static bool decimal_equal(span<const uint8_t> v1, uint8_t scale1, span<const uint8_t> v2, uint8_t scale2) noexcept {
+	array<uint32_t, 4> m1{}, m2{};
+
+	if (scale1 < scale2) {
+		swap(v1, v2);
+		swap(scale1, scale2);
+	}
+
+	memcpy(m1.data(), v1.data() + 1, min(v1.size() - 1, sizeof(m1)));
+	memcpy(m2.data(), v2.data() + 1, min(v2.size() - 1, sizeof(m2)));
+
+	for (auto s = scale1; s > scale2; s--) {
+		uint64_t rem = 0;
+
+		for (auto it = m1.rbegin(); it != m1.rend(); it++) {
+			auto cur = (rem << 32) | *it;
+
+			*it = (uint32_t)(cur / 10);
+			rem = cur % 10;
+		}
+
+		if (rem != 0)
+			return false;
+	}
+
+	if (m1 != m2)
+		return false;
+
+	return v1[0] == v2[0] || m1 == array<uint32_t, 4>{}; // zero can have either sign
+}
+
+// How a non-key column gets compared, which is worked out once from the column metadata
+// so that the loop over the rows doesn't need to look at the types.
+
+struct column_plan;
+
+using compare_kernel = void (*)(const column_plan& p, const column_batch& c1, const column_batch& c2,
+								span<const pair<size_t, size_t>> matches, vector<size_t>& diffs);
+
+struct column_plan {
+	compare_kernel kernel;
+	bool raw_equal; // if byte-identical values are always equal
+	const tds::column* col1;
+	const tds::column* col2;
+};
+
+static void compare_bytes(const column_plan&, const column_batch& c1, const column_batch& c2,
+						  span<const pair<size_t, size_t>> matches, vector<size_t>& diffs) {
+	if (c1.fixed && c2.fixed && c1.width == c2.width) {
+		switch (c1.width) {
+			case 1:
+				compare_fixed<1>(c1, c2, matches, diffs);
+				return;
+
+			case 2:
+				compare_fixed<2>(c1, c2, matches, diffs);
+				return;
+
+			case 4:
+				compare_fixed<4>(c1, c2, matches, diffs);
+				return;
+
+			case 8:
+				compare_fixed<8>(c1, c2, matches, diffs);
+				return;
+
+			default:
+				compare_fixed<0>(c1, c2, matches, diffs);
+				return;
+		}
+	}
+
+	compare_values(c1, c2, matches, diffs, [](span<const uint8_t> v1, span<const uint8_t> v2) {
+		return v1.size() == v2.size() && !memcmp(v1.data(), v2.data(), v1.size());
+	});
+}
+
+static void compare_real(const column_plan&, const column_batch& c1, const column_batch& c2,
+						 span<const pair<size_t, size_t>> matches, vector<size_t>& diffs) {
+	compare_values(c1, c2, matches, diffs, [](span<const uint8_t> v1, span<const uint8_t> v2) {
+		float f1, f2;
+
+		memcpy(&f1, v1.data(), sizeof(float));
+		memcpy(&f2, v2.data(), sizeof(float));
+
+		return float_close<float, int32_t>(f1, f2, REAL_ULPS);
+	});
+}
+
+static void compare_float(const column_plan&, const column_batch& c1, const column_batch& c2,
+						  span<const pair<size_t, size_t>> matches, vector<size_t>& diffs) {
+	compare_values(c1, c2, matches, diffs, [](span<const uint8_t> v1, span<const uint8_t> v2) {
+		double d1, d2;
+
+		memcpy(&d1, v1.data(), sizeof(double));
+		memcpy(&d2, v2.data(), sizeof(double));
+
+		return float_close<double, int64_t>(d1, d2, FLOAT_ULPS);
+	});
+}
+
+static void compare_decimal(const column_plan& p, const column_batch& c1, const column_batch& c2,
+							span<const pair<size_t, size_t>> matches, vector<size_t>& diffs) {
+	auto scale1 = p.col1->scale;
+	auto scale2 = p.col2->scale;
+
+	compare_values(c1, c2, matches, diffs, [&](span<const uint8_t> v1, span<const uint8_t> v2) {
+		return decimal_equal(v1, scale1, v2, scale2);
+	});
+}
+
+// The remaining kernels go through tds::value, reusing a copy of each column's metadata.
+
+template<typename F>
+static void compare_through_values(const column_plan& p, const column_batch& c1, const column_batch& c2,
+								   span<const pair<size_t, size_t>> matches, vector<size_t>& diffs, const F& eq) {
+	tds::value v1 = *p.col1, v2 = *p.col2;
+
+	v1.is_null = v2.is_null = false;
+
+	compare_values(c1, c2, matches, diffs, [&](span<const uint8_t> d1, span<const uint8_t> d2) {
+		v1.val.assign(d1.begin(), d1.end());
+		v2.val.assign(d2.begin(), d2.end());
+
+		return eq(v1, v2);
+	});
+}
+
+// strings in different collations or encodings, which have to be decoded to be compared
+
+static void compare_string(const column_plan& p, const column_batch& c1, const column_batch& c2,
+						   span<const pair<size_t, size_t>> matches, vector<size_t>& diffs) {
+	compare_through_values(p, c1, c2, matches, diffs, [](const tds::value& v1, const tds::value& v2) {
+		return (u16string)v1 == (u16string)v2;
+	});
+}
+
+// mixtures of REAL, FLOAT and other numeric types
+
+static void compare_as_double(const column_plan& p, const column_batch& c1, const column_batch& c2,
+							  span<const pair<size_t, size_t>> matches, vector<size_t>& diffs) {
+	compare_through_values(p, c1, c2, matches, diffs, [](const tds::value& v1, const tds::value& v2) {
+		return float_close<double, int64_t>((double)v1, (double)v2, FLOAT_ULPS);
+	});
+}
+
+static void compare_generic(const column_plan& p, const column_batch& c1, const column_batch& c2,
+							span<const pair<size_t, size_t>> matches, vector<size_t>& diffs) {
+	compare_through_values(p, c1, c2, matches, diffs, [](const tds::value& v1, const tds::value& v2) {
+		return v1 == v2;
+	});
+}
+
+static bool is_float_type(const optional<tds::sql_type>& t) noexcept {
+	return t == tds::sql_type::REAL || t == tds::sql_type::FLOAT;
+}
+
+static bool is_narrow_string(tds::sql_type t) noexcept {
+	return t == tds::sql_type::VARCHAR || t == tds::sql_type::CHAR || t == tds::sql_type::BIGVARCHAR ||
+		   t == tds::sql_type::BIGCHAR || t == tds::sql_type::TEXT;
+}
+
+static bool is_wide_string(tds::sql_type t) noexcept {
+	return t == tds::sql_type::NVARCHAR || t == tds::sql_type::NCHAR || t == tds::sql_type::NTEXT;
+}
+
+static bool is_binary_type(tds::sql_type t) noexcept {
+	return t == tds::sql_type::VARBINARY || t == tds::sql_type::BINARY || t == tds::sql_type::BIGVARBINARY ||
+		   t == tds::sql_type::BIGBINARY || t == tds::sql_type::IMAGE;
+}
+
+static column_plan plan_column(const tds::column& c1, const tds::column& c2) {
+	auto t1 = fixed_width_type(c1);
+	auto t2 = fixed_width_type(c2);
+
+	if (bytes_comparable(c1, c2))
+		return {compare_bytes, true, &c1, &c2};
+
+	if (t1 == t2 && t1 == tds::sql_type::REAL)
+		return {compare_real, true, &c1, &c2};
+
+	if (t1 == t2 && t1 == tds::sql_type::FLOAT)
+		return {compare_float, true, &c1, &c2};
+
+	if (t1 == t2 && t1 == tds::sql_type::DECIMAL)
+		return {compare_decimal, false, &c1, &c2};
+
+	if (is_float_type(t1) || is_float_type(t2))
+		return {compare_as_double, false, &c1, &c2};
+
+	// UTF-16 strings, or narrow strings with the same code page, can be compared as they are
+
+	if (is_wide_string(c1.type) && is_wide_string(c2.type))
+		return {compare_bytes, true, &c1, &c2};
+
+	if (c1.type == c2.type && is_binary_type(c1.type))
+		return {compare_bytes, true, &c1, &c2};
+
+	if (is_narrow_string(c1.type) && is_narrow_string(c2.type) && c1.coll.lcid == c2.coll.lcid &&
+		c1.coll.sort_id == c2.coll.sort_id && c1.coll.utf8 == c2.coll.utf8) {
+		return {compare_bytes, true, &c1, &c2};
+	}
+
+	if ((is_narrow_string(c1.type) || is_wide_string(c1.type)) && (is_narrow_string(c2.type) || is_wide_string(c2.type)))
+		return {compare_string, false, &c1, &c2};
+
+	return {compare_generic, false, &c1, &c2};
+}
+
+// Returns n null bits from row onwards, for n up to 64.
+
+static uint64_t null_bits(const column_batch& c, size_t row, size_t n) noexcept {
+	auto word = row / 64;
+	auto bit = row % 64;
+	auto v = c.nulls_ptr[word] >> bit;
+
+	if (bit != 0 && bit + n > 64)
+		v |= c.nulls_ptr[word + 1] << (64 - bit);
+
+	if (n < 64)
+		v &= ((uint64_t)1 << n) - 1;
+
+	return v;
+}
+
+// Returns true if n consecutive values of two columns, starting at r1 and r2, are byte
+// for byte the same, which for most runs of matched rows can be checked with a single
+// memcmp per column.
+
+static bool range_equal(const column_batch& c1, size_t r1, const column_batch& c2, size_t r2, size_t n) noexcept {
+	for (size_t k = 0; k < n; k += 64) {
+		auto len = min<size_t>(n - k, 64);
+
+		if (null_bits(c1, r1 + k, len) != null_bits(c2, r2 + k, len))
+			return false;
+	}
+
+	if (c1.fixed != c2.fixed)
+		return false;
+
+	if (c1.fixed) {
+		if (c1.width != c2.width)
+			return false;
+
+		return c1.width == 0 || !memcmp(c1.data_ptr + (r1 * c1.width), c2.data_ptr + (r2 * c2.width), n * c1.width);
+	}
+
+	auto o1 = c1.offsets_ptr + r1;
+	auto o2 = c2.offsets_ptr + r2;
+
+	for (size_t k = 1; k <= n; k++) {
+		if (o1[k] - o1[0] != o2[k] - o2[0])
+			return false;
+	}
+
+	return o1[n] == o1[0] || !memcmp(c1.data_ptr + o1[0], c2.data_ptr + o2[0], o1[n] - o1[0]);
+}
+
+template<bool do_new>
+void compare_range(batch_queue& t1, batch_queue& t2, diff_sink& b, compare_stats& stats,
+				   unsigned int num, unsigned int pk_columns, bool pk_only, bool multiset) {
+	auto range_start = chrono::steady_clock::now();
+	uint64_t send_wait = 0;
+	batch_cursor s1(t1), s2(t2);
+	unsigned int num_rows1 = 0, num_rows2 = 0, changed_rows = 0, added_rows = 0, removed_rows = 0;
+	size_t bytes1 = 0, bytes2 = 0;
+	unsigned int rows_since_update = 0, rownum = 0, repeat = 0;
+	uint64_t last_hash = 0;
+	list<diff_arena> arena;
+	vector<pair<size_t, size_t>> matches;
+	vector<size_t> diffs, row_keys;
+	vector<uint8_t> changed;
+	vector<pair<size_t, size_t>> runs;
+
+	if (s1.next_batch())
+		bytes1 += s1.batch().bytes;
+
+	if (s2.next_batch())
+		bytes2 += s2.batch().bytes;
+
+	if (t1.cols.size() != t2.cols.size())
+		throw formatted_error("Streams have different numbers of columns ({} and {}).", t1.cols.size(), t2.cols.size());
+
+	// work out once which columns can be compared without going through tds::value
+
+	auto num_cols = (unsigned int)t1.cols.size();
+	auto key_columns = pk_columns == 0 ? num_cols : pk_columns;
+	vector<bool> int_keys(key_columns);
+	vector<column_plan> plan;
+
+	plan.reserve(num_cols);
+
+	for (unsigned int i = 0; i < num_cols; i++) {
+		plan.push_back(plan_column(t1.cols[i], t2.cols[i]));
+
+		if (i < key_columns)
+			int_keys[i] = is_int_type(fixed_width_type(t1.cols[i])) && is_int_type(fixed_width_type(t2.cols[i]));
+	}
+
+	// the types and names of the columns are only stored once, rather than in every record
+
+	auto schema = make_shared<diff_schema>();
+
+	schema->pk_only = pk_only;
+	schema->num = num;
+
+	auto type_of = [](const tds::value& v) {
+		auto ret = v;
+
+		ret.val.clear();
+
+		return ret;
+	};
+
+	if constexpr (do_new) {
+		for (unsigned int i = 0; i < pk_columns; i++) {
+			schema->keys.push_back(type_of(t1.cols[i]));
+		}
+	} else
+		schema->keys.emplace_back(string_view{});
+
+	for (unsigned int i = 0; i < num_cols; i++) {
+		schema->cols1.push_back(type_of(t1.cols[i]));
+		schema->cols2.push_back(type_of(t2.cols[i]));
+		schema->col_nums.emplace_back((int32_t)(i + 1));
+		schema->names.emplace_back(t1.cols[i].name);
+	}
+
+	auto new_arena = [&]() {
+		{
+			lock_guard<mutex> lg(b.lock);
+
+			if (!b.spare.empty())
+				arena.splice(arena.end(), b.spare, b.spare.begin());
+		}
+
+		if (arena.empty())
+			arena.emplace_back();
+
+		arena.front().reset(schema);
+	};
+
+	auto send_arena = [&]() {
+		auto start = chrono::steady_clock::now();
+
+		mem_budget.wait({}, [&]() noexcept {
+			return b.queued == 0 || b.exc;
+		});
+
+		send_wait += elapsed_ns(start);
+
+		arena.front().charge.set(mem_budget, arena.front().memory());
+
+		{
+			lock_guard<mutex> lg(b.lock);
+
+			b.res.splice(b.res.end(), arena);
+			b.queued++;
+		}
+
+		b.cv.notify_one();
+	};
+
+	new_arena();
+
+	auto add_key = [&](batch_cursor& s, size_t r) {
+		auto& a = arena.front();
+
+		if constexpr (do_new)
+			return a.add_key(s.batch(), r, pk_columns);
+		else {
+			if (pk_columns == 0) {
+				if (multiset)
+					return a.add_key(pseudo_pk(hash_row(s.batch(), r, int_keys), last_hash, repeat));
+
+				return a.add_key(pseudo_pk(rownum));
+			}
+
+			for (uint16_t j = 0; j < pk_columns; j++) {
+				s.load(r, j);
+			}
+
+			return a.add_key(make_pk_string(s.t.cols, pk_columns));
+		}
+	};
+
+	static const diff_value null_value{0, 0, true};
+
+	// Compares the non-key columns of the matched rows a column at a time, which has to
+	// happen before either of the batches they point into is handed back.
+
+	auto flush = [&]() {
+		if (matches.empty())
+			return;
+
+		const auto& b1 = s1.batch();
+		const auto& b2 = s2.batch();
+
+		changed.assign(matches.size(), 0);
+		row_keys.assign(matches.size(), SIZE_MAX);
+
+		// split the matches into runs where both sides are on consecutive rows
+
+		runs.clear();
+
+		for (size_t j = 0; j < matches.size(); j++) {
+			if (j == 0 || matches[j].first != matches[j - 1].first + 1 || matches[j].second != matches[j - 1].second + 1)
+				runs.emplace_back(j, 0);
+
+			runs.back().second++;
+		}
+
+		for (uint16_t i = (uint16_t)pk_columns; i < num_cols; i++) {
+			const auto& c1 = b1.columns[i];
+			const auto& c2 = b2.columns[i];
+
+			diffs.clear();
+
+			if (!plan[i].raw_equal)
+				plan[i].kernel(plan[i], c1, c2, matches, diffs);
+			else {
+				// only look at the values individually in runs which aren't identical
+
+				for (auto [start, len] : runs) {
+					if (range_equal(c1, matches[start].first, c2, matches[start].second, len))
+						continue;
+
+					auto first_diff = diffs.size();
+
+					plan[i].kernel(plan[i], c1, c2, span(matches).subspan(start, len), diffs);
+
+					for (auto k = first_diff; k < diffs.size(); k++) {
+						diffs[k] += start;
+					}
+				}
+			}
+
+			auto& a = arena.front();
+
+			for (auto j : diffs) {
+				auto [r1, r2] = matches[j];
+
+				if (row_keys[j] == SIZE_MAX)
+					row_keys[j] = add_key(s1, r1);
+
+				a.add(row_keys[j], diff_change::modified, i, a.add_value(s1.batch_ptr(), i, r1),
+					  a.add_value(s2.batch_ptr(), i, r2));
+				changed[j] = 1;
+			}
+		}
+
+		changed_rows += (unsigned int)count(changed.begin(), changed.end(), 1);
+
+		matches.clear();
+	};
+
+	auto advance1 = [&]() {
+		if (++s1.row == s1.batch().num_rows) {
+			flush();
+
+			if (s1.next_batch())
+				bytes1 += s1.batch().bytes;
+		}
+	};
+
+	auto advance2 = [&]() {
+		if (++s2.row == s2.batch().num_rows) {
+			flush();
+
+			if (s2.next_batch())
+				bytes2 += s2.batch().bytes;
+		}
+	};
+
+	auto emit_removed = [&]() {
+		auto& a = arena.front();
+		auto key = add_key(s1, s1.row);
+
+		if (pk_only)
+			a.add(key, diff_change::removed, 0, null_value, null_value);
+		else {
+			for (auto i = (uint16_t)pk_columns; i < num_cols; i++) {
+				a.add(key, diff_change::removed, i, a.add_value(s1.batch_ptr(), i, s1.row), null_value);
+			}
+		}
+
+		removed_rows++;
+		num_rows1++;
+	};
+
+	auto emit_added = [&]() {
+		auto& a = arena.front();
+		auto key = add_key(s2, s2.row);
+
+		if (pk_only)
+			a.add(key, diff_change::added, 0, null_value, null_value);
+		else {
+			for (auto i = (uint16_t)pk_columns; i < num_cols; i++) {
+				a.add(key, diff_change::added, i, null_value, a.add_value(s2.batch_ptr(), i, s2.row));
+			}
+		}
+
+		added_rows++;
+		num_rows2++;
+	};
+
+	// counters are kept locally and added to the shared totals in batches, so that
+	// parallel ranges aren't all fighting over the same cache lines
+
+	auto publish = [&]() {
+		stats.rows1 += num_rows1;
+		stats.rows2 += num_rows2;
+		stats.changed_rows += changed_rows;
+		stats.added_rows += added_rows;
+		stats.removed_rows += removed_rows;
+		stats.bytes1 += bytes1;
+		stats.bytes2 += bytes2;
+
+		num_rows1 = num_rows2 = changed_rows = added_rows = removed_rows = 0;
+		bytes1 = bytes2 = 0;
+	};
+
+	while (!s1.finished || !s2.finished) {
+		if (b.exc)
+			rethrow_exception(b.exc);
+
+		if (!s1.finished && !s2.finished) {
+			auto cmp = compare_keys(s1, s2, int_keys, key_columns);
+
+			if (cmp == weak_ordering::equivalent) {
+				if (pk_columns > 0)
+					matches.emplace_back(s1.row, s2.row);
+
+				num_rows1++;
+				num_rows2++;
+
+				advance1();
+				advance2();
+			} else if (cmp == weak_ordering::less) {
+				emit_removed();
+				advance1();
+			} else {
+				emit_added();
+				advance2();
+			}
+		} else if (!s1.finished) {
+			emit_removed();
+			advance1();
+		} else {
+			emit_added();
+			advance2();
+		}
+
+		if (arena.front().full()) {
+			send_arena();
+			new_arena();
+		}
+
+		if (rows_since_update > 1000) {
+			publish();
+
+			rows_since_update = 0;
+		} else
+			rows_since_update++;
+	}
+
+	if (!arena.front().records.empty())
+		send_arena();
+
+	publish();
+
+	// time spent merging is what's left once the waits on the streams and the bcp queue are taken out
+
+	auto waits = t1.starved_ns + t2.starved_ns + send_wait;
+	auto total = elapsed_ns(range_start);
+
+	stats.merge_ns += total - min(waits, total);
+	stats.send_wait_ns += send_wait;
+}
+
+template void compare_range<false>(batch_queue& t1, batch_queue& t2, diff_sink& b, compare_stats& stats,
+								   unsigned int num, unsigned int pk_columns, bool pk_only, bool multiset);
+template void compare_range<true>(batch_queue& t1, batch_queue& t2, diff_sink& b, compare_stats& stats,
+								  unsigned int num, unsigned int pk_columns, bool pk_only, bool multiset);
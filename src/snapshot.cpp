@@ -0,0 +1,340 @@
+#include "comparer.h"
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// A snapshot is a header describing the columns, then a block for each batch, then an
+// index giving the offset and number of rows of each block, and a fixed-size footer
+// pointing to the index. Everything is little-endian and 8-byte aligned, so that the
+// arrays in a block can be used where they are in the mapping.
+//
+// Each block is its number of rows and bytes, then for each column its fixed flag,
+// width and data length, followed by its null bitmap, its offsets if it's not fixed,
+// and its data.
+
+static constexpr char SNAPSHOT_MAGIC[4] = { 'C', 'M', 'P', 'S' };
+static constexpr uint16_t SNAPSHOT_VERSION = 1;
+static constexpr size_t SNAPSHOT_FOOTER_SIZE = 32;
+static constexpr size_t FILE_BUFFER_SIZE = 1048576; // 1 MB
+
+#ifndef _WIN32
+
+errno_error::errno_error(string_view function, int en) {
+	msg = string(function) + " failed (error " + to_string(en) + ", " + strerror(en) + ").";
+}
+
+#endif
+
+mapped_file::mapped_file(const filesystem::path& fn) {
+#ifdef _WIN32
+	h.reset(CreateFileW((LPCWSTR)fn.u16string().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+						FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
+
+	if (h.get() == INVALID_HANDLE_VALUE)
+		throw last_error("CreateFile", GetLastError());
+
+	LARGE_INTEGER li;
+
+	if (!GetFileSizeEx(h.get(), &li))
+		throw last_error("GetFileSizeEx", GetLastError());
+
+	size = (size_t)li.QuadPart;
+
+	if (size == 0)
+		return;
+
+	mapping.reset(CreateFileMappingW(h.get(), nullptr, PAGE_READONLY, 0, 0, nullptr));
+
+	if (!mapping)
+		throw last_error("CreateFileMapping", GetLastError());
+
+	ptr = (const uint8_t*)MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0, 0);
+
+	if (!ptr)
+		throw last_error("MapViewOfFile", GetLastError());
+#else
+	h.reset(::open(fn.c_str(), O_RDONLY));
+
+	if (h.get() < 0)
+		throw errno_error("open", errno);
+
+	struct stat st;
+
+	if (fstat(h.get(), &st) != 0)
+		throw errno_error("fstat", errno);
+
+	size = (size_t)st.st_size;
+
+	if (size == 0)
+		return;
+
+	auto p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, h.get(), 0);
+
+	if (p == MAP_FAILED)
+		throw errno_error("mmap", errno);
+
+	ptr = (const uint8_t*)p;
+
+	// the merge reads it front to back
+
+	madvise(p, size, MADV_SEQUENTIAL);
+#endif
+}
+
+mapped_file::~mapped_file() {
+	if (!ptr)
+		return;
+
+#ifdef _WIN32
+	UnmapViewOfFile(ptr);
+#else
+	munmap((void*)ptr, size);
+#endif
+}
+
+snapshot_writer::snapshot_writer(const filesystem::path& fn) : fn(fn), buf(FILE_BUFFER_SIZE) {
+	tmp = fn;
+	tmp += ".tmp";
+
+	f.rdbuf()->pubsetbuf(buf.data(), (streamsize)buf.size());
+	f.exceptions(ios::failbit | ios::badbit);
+	f.open(tmp, ios::binary | ios::trunc);
+}
+
+snapshot_writer::~snapshot_writer() {
+	if (finished)
+		return;
+
+	// don't leave a half-written snapshot behind
+
+	try {
+		f.close();
+	} catch (...) {
+	}
+
+	error_code ec;
+
+	filesystem::remove(tmp, ec);
+}
+
+template<typename T>
+static void put(ofstream& f, uint64_t& pos, T t) {
+	f.write((const char*)&t, sizeof(t));
+	pos += sizeof(t);
+}
+
+static void put_bytes(ofstream& f, uint64_t& pos, const void* data, size_t len) {
+	f.write((const char*)data, (streamsize)len);
+	pos += len;
+}
+
+void snapshot_writer::pad() {
+	static const char zeroes[8] = {};
+
+	if (pos % 8 != 0)
+		put_bytes(f, pos, zeroes, 8 - (pos % 8));
+}
+
+void snapshot_writer::start(span<const tds::column> cols) {
+	put_bytes(f, pos, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	put(f, pos, SNAPSHOT_VERSION);
+	put(f, pos, (uint16_t)cols.size());
+
+	for (const auto& c : cols) {
+		uint32_t coll;
+
+		memcpy(&coll, &c.coll, sizeof(coll));
+
+		put(f, pos, (uint8_t)c.type);
+		put(f, pos, (uint32_t)c.max_length);
+		put(f, pos, c.precision);
+		put(f, pos, c.scale);
+		put(f, pos, coll);
+		put(f, pos, c.coll.sort_id);
+		put(f, pos, (uint16_t)c.name.size());
+		put_bytes(f, pos, c.name.data(), c.name.size() * sizeof(char16_t));
+	}
+
+	pad();
+}
+
+void snapshot_writer::write_batch(const row_batch& b) {
+	index.push_back({pos, b.num_rows});
+
+	put(f, pos, (uint64_t)b.num_rows);
+	put(f, pos, (uint64_t)b.bytes);
+
+	for (const auto& c : b.columns) {
+		auto data_len = c.fixed ? b.num_rows * c.width : c.offsets_ptr[b.num_rows];
+
+		put(f, pos, (uint64_t)c.fixed);
+		put(f, pos, (uint64_t)c.width);
+		put(f, pos, (uint64_t)data_len);
+
+		put_bytes(f, pos, c.nulls_ptr, ((b.num_rows + 63) / 64) * sizeof(uint64_t));
+
+		if (!c.fixed)
+			put_bytes(f, pos, c.offsets_ptr, (b.num_rows + 1) * sizeof(size_t));
+
+		put_bytes(f, pos, c.data_ptr, data_len);
+		pad();
+	}
+}
+
+void snapshot_writer::finish() {
+	auto index_offset = pos;
+	uint64_t total_rows = 0;
+
+	for (const auto& i : index) {
+		put(f, pos, i[0]);
+		put(f, pos, i[1]);
+		total_rows += i[1];
+	}
+
+	put(f, pos, index_offset);
+	put(f, pos, (uint64_t)index.size());
+	put(f, pos, total_rows);
+	put_bytes(f, pos, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	put(f, pos, (uint32_t)0);
+
+	f.close();
+
+	filesystem::rename(tmp, fn);
+	finished = true;
+}
+
+template<typename T>
+static T get(span<const uint8_t> sp, size_t& off, const filesystem::path& fn) {
+	T t;
+
+	if (off + sizeof(T) > sp.size())
+		throw formatted_error("{} is truncated.", fn.string());
+
+	memcpy(&t, sp.data() + off, sizeof(T));
+	off += sizeof(T);
+
+	return t;
+}
+
+vector<tds::column> snapshot_source::open() {
+	static_assert(sizeof(size_t) == sizeof(uint64_t), "snapshot offsets are mapped as size_t");
+
+	file = make_shared<mapped_file>(fn);
+
+	auto sp = file->data();
+	size_t off = 0;
+
+	if (sp.size() < sizeof(SNAPSHOT_MAGIC) + SNAPSHOT_FOOTER_SIZE || memcmp(sp.data(), SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)))
+		throw formatted_error("{} is not a comparer snapshot.", fn.string());
+
+	off += sizeof(SNAPSHOT_MAGIC);
+
+	if (auto version = get<uint16_t>(sp, off, fn); version != SNAPSHOT_VERSION)
+		throw formatted_error("{} has unsupported version {}.", fn.string(), version);
+
+	num_cols = get<uint16_t>(sp, off, fn);
+
+	vector<tds::column> cols(num_cols);
+
+	for (auto& c : cols) {
+		c.type = (tds::sql_type)get<uint8_t>(sp, off, fn);
+		c.max_length = get<uint32_t>(sp, off, fn);
+		c.precision = get<uint8_t>(sp, off, fn);
+		c.scale = get<uint8_t>(sp, off, fn);
+
+		auto coll = get<uint32_t>(sp, off, fn);
+
+		memcpy(&c.coll, &coll, sizeof(coll));
+		c.coll.sort_id = get<uint8_t>(sp, off, fn);
+		c.nullable = true;
+		c.is_null = false;
+
+		c.name.resize(get<uint16_t>(sp, off, fn));
+
+		if (off + (c.name.size() * sizeof(char16_t)) > sp.size())
+			throw formatted_error("{} is truncated.", fn.string());
+
+		memcpy(c.name.data(), sp.data() + off, c.name.size() * sizeof(char16_t));
+		off += c.name.size() * sizeof(char16_t);
+	}
+
+	// the footer says where the index is
+
+	auto foot = sp.size() - SNAPSHOT_FOOTER_SIZE;
+	auto index_offset = get<uint64_t>(sp, foot, fn);
+	auto num_blocks = get<uint64_t>(sp, foot, fn);
+
+	foot += sizeof(uint64_t); // total rows
+
+	if (memcmp(sp.data() + foot, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)))
+		throw formatted_error("{} is incomplete.", fn.string());
+
+	if (index_offset > sp.size() - SNAPSHOT_FOOTER_SIZE ||
+		num_blocks > (sp.size() - SNAPSHOT_FOOTER_SIZE - index_offset) / (2 * sizeof(uint64_t))) {
+		throw formatted_error("{} has an invalid index.", fn.string());
+	}
+
+	blocks = sp.subspan(index_offset, num_blocks * 2 * sizeof(uint64_t));
+
+	return cols;
+}
+
+bool snapshot_source::fetch_row() {
+	if (next_block == blocks.size() / (2 * sizeof(uint64_t)))
+		return false;
+
+	block = next_block++;
+
+	return true;
+}
+
+void snapshot_source::add_row(row_batch&) {
+	throw runtime_error("snapshot_source can only read whole batches.");
+}
+
+// Points b at the current block, rather than copying it.
+
+void snapshot_source::read_batch(row_batch& b) {
+	auto sp = file->data();
+	size_t idx = block * 2 * sizeof(uint64_t);
+	auto off = (size_t)get<uint64_t>(blocks, idx, fn);
+
+	if (off % 8 != 0)
+		throw formatted_error("{} has an invalid index.", fn.string());
+
+	b.num_rows = (size_t)get<uint64_t>(sp, off, fn);
+	b.bytes = (size_t)get<uint64_t>(sp, off, fn);
+	b.columns.resize(num_cols);
+	b.backing = file;
+
+	for (auto& c : b.columns) {
+		c.fixed = get<uint64_t>(sp, off, fn) != 0;
+		c.width = (size_t)get<uint64_t>(sp, off, fn);
+
+		auto data_len = (size_t)get<uint64_t>(sp, off, fn);
+		auto nulls_len = ((b.num_rows + 63) / 64) * sizeof(uint64_t);
+		auto offsets_len = c.fixed ? 0 : (b.num_rows + 1) * sizeof(size_t);
+
+		if (off + nulls_len + offsets_len + data_len > sp.size())
+			throw formatted_error("{} is truncated.", fn.string());
+
+		c.nulls_ptr = (const uint64_t*)(sp.data() + off);
+		off += nulls_len;
+
+		c.offsets_ptr = c.fixed ? nullptr : (const size_t*)(sp.data() + off);
+		off += offsets_len;
+
+		c.data_ptr = sp.data() + off;
+		off += (data_len + 7) & ~(size_t)7;
+
+		if (c.fixed ? b.num_rows * c.width != data_len : c.offsets_ptr[b.num_rows] != data_len)
+			throw formatted_error("{} has an invalid block.", fn.string());
+	}
+}
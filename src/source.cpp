@@ -0,0 +1,824 @@
+#include "comparer.h"
+#include <cstring>
+#include <charconv>
+#include <chrono>
+#include <array>
+#include <algorithm>
+
+using namespace std;
+
+static constexpr size_t FILE_BUFFER_SIZE = 1048576; // 1 MB
+static constexpr char BINARY_MAGIC[4] = { 'C', 'M', 'P', 'R' };
+static constexpr uint16_t BINARY_VERSION = 1;
+static constexpr uint32_t BINARY_NULL = 0xffffffff;
+
+sql_thread::sql_thread(u16string_view query, unique_ptr<tds::tds>& tds, snapshot_writer* tee) : uptds(move(tds)), tee(tee) {
+	source = make_unique<tds_source>(*uptds, query);
+
+	t = jthread([&](stop_token stop, sql_thread* st) noexcept {
+		st->run(stop);
+	}, this);
+}
+
+sql_thread::sql_thread(unique_ptr<row_source> source, snapshot_writer* tee, unsigned int check_keys) :
+	source(move(source)), tee(tee), check_keys(check_keys) {
+	t = jthread([&](stop_token stop, sql_thread* st) noexcept {
+		st->run(stop);
+	}, this);
+}
+
+void sql_thread::run(stop_token stop) noexcept {
+	try {
+		auto start = chrono::steady_clock::now();
+
+		cols = source->open();
+
+		if (tee)
+			tee->start(cols);
+
+		vector<bool> fixed(cols.size());
+
+		for (size_t i = 0; i < cols.size(); i++) {
+			fixed[i] = fixed_width_type(cols[i]).has_value();
+		}
+
+		// A file isn't sorted by a server, so its order is checked as it's read - rows out
+		// of order would have the merge pair up the wrong ones. The last row of each batch
+		// is kept, to check the next batch's first row against.
+
+		vector<bool> int_keys(check_keys);
+		auto scratch1 = cols, scratch2 = cols;
+		row_batch last;
+		uint64_t rows_read = 0;
+
+		if (check_keys > cols.size())
+			throw formatted_error("Stream has {} columns, but {} key columns.", cols.size(), check_keys);
+
+		for (unsigned int i = 0; i < check_keys; i++) {
+			int_keys[i] = is_int_type(fixed_width_type(cols[i]));
+		}
+
+		auto check_order = [&](const row_batch& c) {
+			for (size_t r = 0; r < c.num_rows; r++) {
+				if (r == 0 && last.num_rows == 0)
+					continue;
+
+				auto cmp = r == 0 ? compare_row_keys(last, 0, c, 0, int_keys, scratch1, scratch2)
+								  : compare_row_keys(c, r - 1, c, r, int_keys, scratch1, scratch2);
+
+				if (cmp >= 0)
+					throw formatted_error("Row {} is not after the one before it in key order. Files have to be sorted by their key, in the same order as the server.", rows_read + r + 1);
+			}
+
+			rows_read += c.num_rows;
+
+			if (c.num_rows != 0) {
+				last.reset(fixed);
+				last.add_row(c, c.num_rows - 1);
+				last.seal();
+			}
+		};
+
+		auto b = source->fetch_row();
+
+		fetch_ns += elapsed_ns(start);
+
+		while (b) {
+			decltype(results) l;
+
+			if (!reserve(stop, l))
+				break;
+
+			auto& c = *l.front();
+
+			c.reset(fixed);
+
+			source->read_batch(c);
+
+			if (check_keys != 0)
+				check_order(c);
+
+			if (tee)
+				tee->write_batch(c);
+
+			submit(l);
+
+			start = chrono::steady_clock::now();
+			b = source->fetch_row();
+			fetch_ns += elapsed_ns(start);
+		}
+	} catch (...) {
+		ex = current_exception();
+	}
+
+	// the connection may be taken back once we've finished, so the query can't outlive this
+
+	source->close();
+
+	finish();
+}
+
+sql_thread::~sql_thread() {
+	t.request_stop();
+	cv.notify_all();
+}
+
+vector<tds::column> tds_source::open() {
+	sq.emplace(tds, tds::no_check{query});
+
+	vector<tds::column> cols;
+	auto num_col = sq->num_columns();
+
+	cols.reserve(num_col);
+
+	for (uint16_t i = 0; i < num_col; i++) {
+		cols.emplace_back((*sq)[i]);
+	}
+
+	return cols;
+}
+
+bool tds_source::fetch_row() {
+	return sq->fetch_row();
+}
+
+bool tds_source::fetch_row_no_wait() {
+	return sq->fetch_row_no_wait();
+}
+
+void tds_source::add_row(row_batch& b) {
+	b.add_row(*sq);
+}
+
+void tds_source::close() noexcept {
+	try {
+		sq.reset();
+	} catch (...) {
+	}
+}
+
+static string_view trim(string_view sv) {
+	while (!sv.empty() && (sv.front() == ' ' || sv.front() == '\t' || sv.front() == '\r')) {
+		sv.remove_prefix(1);
+	}
+
+	while (!sv.empty() && (sv.back() == ' ' || sv.back() == '\t' || sv.back() == '\r')) {
+		sv.remove_suffix(1);
+	}
+
+	return sv;
+}
+
+static string lower(string_view sv) {
+	string s{sv};
+
+	for (auto& c : s) {
+		if (c >= 'A' && c <= 'Z')
+			c = (char)(c - 'A' + 'a');
+	}
+
+	return s;
+}
+
+template<typename T>
+static T parse_field(string_view sv, string_view what) {
+	T t;
+
+	auto [ptr, ec] = from_chars(sv.data(), sv.data() + sv.length(), t);
+
+	if (ec != errc() || ptr != sv.data() + sv.length())
+		throw formatted_error("Could not parse \"{}\" as {}.", sv, what);
+
+	return t;
+}
+
+// Parses a column declaration from a CSV header, such as "name nvarchar(50)", into the
+// type a query returning that column would have.
+
+static tds::column parse_declaration(string_view decl) {
+	tds::column c;
+
+	decl = trim(decl);
+
+	auto sp = decl.find_last_of(" \t", decl.find('(') == string_view::npos ? string_view::npos : decl.find('('));
+
+	if (sp == string_view::npos)
+		throw formatted_error("Column declaration \"{}\" has no type.", decl);
+
+	c.name = tds::utf8_to_utf16(trim(decl.substr(0, sp)));
+	c.nullable = true;
+	c.is_null = false;
+	c.precision = 0;
+	c.scale = 0;
+	c.coll = {};
+
+	auto type_str = trim(decl.substr(sp + 1));
+	auto type = lower(trim(type_str.substr(0, type_str.find('('))));
+	optional<unsigned int> arg1, arg2;
+	bool max = false;
+
+	if (auto bracket = type_str.find('('); bracket != string_view::npos) {
+		auto args = type_str.substr(bracket + 1);
+
+		if (args.empty() || args.back() != ')')
+			throw formatted_error("Could not parse type \"{}\".", type_str);
+
+		args.remove_suffix(1);
+
+		auto comma = args.find(',');
+		auto a1 = trim(args.substr(0, comma));
+
+		if (lower(a1) == "max")
+			max = true;
+		else
+			arg1 = parse_field<unsigned int>(a1, "length");
+
+		if (comma != string_view::npos)
+			arg2 = parse_field<unsigned int>(trim(args.substr(comma + 1)), "scale");
+	}
+
+	if (type == "bit") {
+		c.type = tds::sql_type::BITN;
+		c.max_length = 1;
+	} else if (type == "tinyint" || type == "smallint" || type == "int" || type == "bigint") {
+		c.type = tds::sql_type::INTN;
+		c.max_length = type == "tinyint" ? 1 : (type == "smallint" ? 2 : (type == "int" ? 4 : 8));
+	} else if (type == "real") {
+		c.type = tds::sql_type::FLTN;
+		c.max_length = 4;
+	} else if (type == "float") {
+		c.type = tds::sql_type::FLTN;
+		c.max_length = arg1.has_value() && *arg1 <= 24 ? 4 : 8;
+	} else if (type == "decimal" || type == "numeric") {
+		c.type = type == "decimal" ? tds::sql_type::DECIMAL : tds::sql_type::NUMERIC;
+		c.precision = (uint8_t)arg1.value_or(18);
+		c.scale = (uint8_t)arg2.value_or(0);
+
+		if (c.precision == 0 || c.precision > 38 || c.scale > c.precision)
+			throw formatted_error("Invalid precision or scale in \"{}\".", type_str);
+
+		c.max_length = c.precision <= 9 ? 5 : (c.precision <= 19 ? 9 : (c.precision <= 28 ? 13 : 17));
+	} else if (type == "char" || type == "varchar" || type == "nchar" || type == "nvarchar") {
+		// the file is UTF-8, so all strings are read as UTF-16
+
+		c.type = tds::sql_type::NVARCHAR;
+		c.max_length = max ? 0xffff : arg1.value_or(1) * 2;
+	} else if (type == "binary" || type == "varbinary") {
+		c.type = tds::sql_type::VARBINARY;
+		c.max_length = max ? 0xffff : arg1.value_or(1);
+	} else if (type == "date") {
+		c.type = tds::sql_type::DATE;
+		c.max_length = 3;
+	} else if (type == "datetime2") {
+		c.type = tds::sql_type::DATETIME2;
+		c.scale = (uint8_t)arg1.value_or(7);
+
+		if (c.scale > 7)
+			throw formatted_error("Invalid scale in \"{}\".", type_str);
+
+		c.max_length = (c.scale <= 2 ? 3 : (c.scale <= 4 ? 4 : 5)) + 3;
+	} else if (type == "uniqueidentifier") {
+		c.type = tds::sql_type::UNIQUEIDENTIFIER;
+		c.max_length = 16;
+	} else
+		throw formatted_error("Unsupported type \"{}\" in CSV header.", type_str);
+
+	return c;
+}
+
+static void store_int(tds::value_data_t& val, uint64_t v, size_t len) {
+	val.resize(len);
+
+	for (size_t i = 0; i < len; i++) {
+		val[i] = (uint8_t)(v >> (i * 8));
+	}
+}
+
+static int32_t parse_date(string_view sv) {
+	if (sv.size() < 10 || sv[4] != '-' || sv[7] != '-')
+		throw formatted_error("Could not parse \"{}\" as date.", sv);
+
+	auto y = parse_field<int>(sv.substr(0, 4), "year");
+	auto m = parse_field<unsigned int>(sv.substr(5, 2), "month");
+	auto d = parse_field<unsigned int>(sv.substr(8, 2), "day");
+	chrono::year_month_day ymd{chrono::year{y}, chrono::month{m}, chrono::day{d}};
+
+	if (!ymd.ok())
+		throw formatted_error("Invalid date \"{}\".", sv);
+
+	static const chrono::sys_days base = chrono::year{1} / 1 / 1;
+
+	return (int32_t)(chrono::sys_days{ymd} - base).count();
+}
+
+static void parse_decimal(tds::value_data_t& val, string_view sv, const tds::column& c) {
+	bool neg = false;
+	unsigned int frac = 0;
+	bool point = false, digits = false;
+
+	val.assign(c.max_length, 0);
+
+	if (!sv.empty() && (sv.front() == '-' || sv.front() == '+')) {
+		neg = sv.front() == '-';
+		sv.remove_prefix(1);
+	}
+
+	// the mantissa is a little-endian integer of the value times 10^scale
+
+	auto add_digit = [&](unsigned int d) {
+		unsigned int carry = d;
+
+		for (size_t i = 1; i < val.size(); i++) {
+			carry += (unsigned int)val[i] * 10;
+			val[i] = (uint8_t)carry;
+			carry >>= 8;
+		}
+
+		if (carry != 0)
+			throw formatted_error("Value \"{}\" is too large for DECIMAL({},{}).", sv, c.precision, c.scale);
+	};
+
+	for (auto ch : sv) {
+		if (ch == '.' && !point)
+			point = true;
+		else if (ch >= '0' && ch <= '9') {
+			digits = true;
+
+			if (point) {
+				if (frac == c.scale)
+					continue; // truncate any extra places
+
+				frac++;
+			}
+
+			add_digit((unsigned int)(ch - '0'));
+		} else
+			throw formatted_error("Could not parse \"{}\" as decimal.", sv);
+	}
+
+	if (!digits)
+		throw formatted_error("Could not parse \"{}\" as decimal.", sv);
+
+	for (; frac < c.scale; frac++) {
+		add_digit(0);
+	}
+
+	val[0] = neg ? 0 : 1;
+}
+
+static uint8_t hex_digit(char c, string_view sv) {
+	if (c >= '0' && c <= '9')
+		return (uint8_t)(c - '0');
+	else if (c >= 'a' && c <= 'f')
+		return (uint8_t)(c - 'a' + 10);
+	else if (c >= 'A' && c <= 'F')
+		return (uint8_t)(c - 'A' + 10);
+
+	throw formatted_error("Could not parse \"{}\" as hex.", sv);
+}
+
+static void parse_hex(tds::value_data_t& val, string_view sv) {
+	auto orig = sv;
+
+	if (sv.starts_with("0x") || sv.starts_with("0X"))
+		sv.remove_prefix(2);
+
+	if (sv.size() % 2 != 0)
+		throw formatted_error("Could not parse \"{}\" as hex.", orig);
+
+	val.resize(sv.size() / 2);
+
+	for (size_t i = 0; i < val.size(); i++) {
+		val[i] = (uint8_t)((hex_digit(sv[i * 2], orig) << 4) | hex_digit(sv[(i * 2) + 1], orig));
+	}
+}
+
+// Converts text from the CSV into the bytes TDS would send for a value of the column's type.
+
+static void parse_value(tds::column& c, string_view sv) {
+	switch (c.type) {
+		case tds::sql_type::BITN: {
+			auto l = lower(sv);
+
+			if (l != "0" && l != "1" && l != "true" && l != "false")
+				throw formatted_error("Could not parse \"{}\" as bit.", sv);
+
+			store_int(c.val, l == "1" || l == "true" ? 1 : 0, 1);
+			break;
+		}
+
+		case tds::sql_type::INTN:
+			// parsed at the column's own width, so that a value which doesn't fit is an
+			// error rather than being truncated
+
+			switch (c.max_length) {
+				case 1:
+					store_int(c.val, parse_field<uint8_t>(sv, "tinyint"), 1);
+					break;
+
+				case 2:
+					store_int(c.val, (uint64_t)parse_field<int16_t>(sv, "smallint"), 2);
+					break;
+
+				case 4:
+					store_int(c.val, (uint64_t)parse_field<int32_t>(sv, "int"), 4);
+					break;
+
+				default:
+					store_int(c.val, (uint64_t)parse_field<int64_t>(sv, "bigint"), c.max_length);
+					break;
+			}
+			break;
+
+		case tds::sql_type::FLTN:
+			if (c.max_length == 4) {
+				auto f = parse_field<float>(sv, "real");
+
+				c.val.resize(sizeof(f));
+				memcpy(c.val.data(), &f, sizeof(f));
+			} else {
+				auto d = parse_field<double>(sv, "float");
+
+				c.val.resize(sizeof(d));
+				memcpy(c.val.data(), &d, sizeof(d));
+			}
+			break;
+
+		case tds::sql_type::DECIMAL:
+		case tds::sql_type::NUMERIC:
+			parse_decimal(c.val, sv, c);
+			break;
+
+		case tds::sql_type::NVARCHAR: {
+			auto s = tds::utf8_to_utf16(sv);
+
+			c.val.resize(s.size() * sizeof(char16_t));
+			memcpy(c.val.data(), s.data(), c.val.size());
+			break;
+		}
+
+		case tds::sql_type::VARBINARY:
+			parse_hex(c.val, sv);
+			break;
+
+		case tds::sql_type::DATE:
+			store_int(c.val, (uint64_t)parse_date(sv), 3);
+			break;
+
+		case tds::sql_type::DATETIME2: {
+			// "YYYY-MM-DD hh:mm:ss[.fffffff]", with a space or a T
+
+			if (sv.size() < 19 || (sv[10] != ' ' && sv[10] != 'T') || sv[13] != ':' || sv[16] != ':')
+				throw formatted_error("Could not parse \"{}\" as datetime2.", sv);
+
+			auto h = parse_field<uint64_t>(sv.substr(11, 2), "hour");
+			auto mi = parse_field<uint64_t>(sv.substr(14, 2), "minute");
+			auto s = parse_field<uint64_t>(sv.substr(17, 2), "second");
+			uint64_t ticks = (h * 3600) + (mi * 60) + s;
+			auto frac = sv.substr(19);
+
+			if (!frac.empty() && frac.front() == '.')
+				frac.remove_prefix(1);
+			else if (!frac.empty())
+				throw formatted_error("Could not parse \"{}\" as datetime2.", sv);
+
+			for (unsigned int i = 0; i < c.scale; i++) {
+				ticks *= 10;
+
+				if (i < frac.size()) {
+					if (frac[i] < '0' || frac[i] > '9')
+						throw formatted_error("Could not parse \"{}\" as datetime2.", sv);
+
+					ticks += (uint64_t)(frac[i] - '0');
+				}
+			}
+
+			auto time_len = c.max_length - 3;
+
+			store_int(c.val, ticks, time_len);
+
+			auto date = parse_date(sv.substr(0, 10));
+
+			c.val.resize(c.max_length);
+
+			for (size_t i = 0; i < 3; i++) {
+				c.val[time_len + i] = (uint8_t)((uint32_t)date >> (i * 8));
+			}
+
+			break;
+		}
+
+		case tds::sql_type::UNIQUEIDENTIFIER: {
+			// the first three groups are stored little-endian
+
+			if (sv.size() != 36 || sv[8] != '-' || sv[13] != '-' || sv[18] != '-' || sv[23] != '-')
+				throw formatted_error("Could not parse \"{}\" as uniqueidentifier.", sv);
+
+			static const array<size_t, 16> pos{ 6, 4, 2, 0, 11, 9, 16, 14, 19, 21, 24, 26, 28, 30, 32, 34 };
+
+			c.val.resize(16);
+
+			for (size_t i = 0; i < 16; i++) {
+				c.val[i] = (uint8_t)((hex_digit(sv[pos[i]], sv) << 4) | hex_digit(sv[pos[i] + 1], sv));
+			}
+
+			break;
+		}
+
+		default:
+			throw formatted_error("Unsupported type {} in CSV column.", (int)c.type);
+	}
+}
+
+csv_source::csv_source(const filesystem::path& fn) : fn(fn), buf(FILE_BUFFER_SIZE) {
+}
+
+// Reads the next record into fields, following RFC 4180. Returns false at the end of the file.
+
+bool csv_source::read_record() {
+	auto& sb = *f.rdbuf();
+	size_t n = 0;
+
+	if (sb.sgetc() == char_traits<char>::eof())
+		return false;
+
+	auto next_field = [&]() -> string& {
+		if (fields.size() <= n) {
+			fields.emplace_back();
+			quoted.push_back(false);
+		}
+
+		fields[n].clear();
+		quoted[n] = false;
+
+		return fields[n++];
+	};
+
+	auto* field = &next_field();
+	bool in_quotes = false;
+
+	while (true) {
+		auto ch = sb.sbumpc();
+
+		if (ch == char_traits<char>::eof()) {
+			if (in_quotes)
+				throw formatted_error("{}: unterminated quote at line {}.", fn.string(), line);
+
+			break;
+		}
+
+		auto c = (char)ch;
+
+		if (in_quotes) {
+			if (c == '"') {
+				if (sb.sgetc() == '"') {
+					sb.sbumpc();
+					*field += '"';
+				} else
+					in_quotes = false;
+			} else {
+				if (c == '\n')
+					line++;
+
+				*field += c;
+			}
+		} else if (c == '"' && field->empty()) {
+			in_quotes = true;
+			quoted[n - 1] = true;
+		} else if (c == ',')
+			field = &next_field();
+		else if (c == '\n') {
+			line++;
+			break;
+		} else if (c != '\r')
+			*field += c;
+	}
+
+	fields.resize(n);
+	quoted.resize(n);
+
+	return true;
+}
+
+vector<tds::column> csv_source::open() {
+	f.rdbuf()->pubsetbuf(buf.data(), (streamsize)buf.size());
+	f.open(fn, ios::binary);
+
+	if (!f.is_open())
+		throw formatted_error("Could not open {}.", fn.string());
+
+	if (!read_record())
+		throw formatted_error("{} is empty.", fn.string());
+
+	vector<tds::column> cols;
+	string decl;
+
+	// a comma inside brackets, as in decimal(10,2), doesn't start a new column
+
+	for (const auto& f : fields) {
+		if (!decl.empty())
+			decl += ',';
+
+		decl += f;
+
+		if (count(decl.begin(), decl.end(), '(') > count(decl.begin(), decl.end(), ')'))
+			continue;
+
+		cols.push_back(parse_declaration(decl));
+		decl.clear();
+	}
+
+	if (!decl.empty())
+		cols.push_back(parse_declaration(decl));
+
+	row = cols;
+
+	return cols;
+}
+
+bool csv_source::fetch_row() {
+	do {
+		if (!read_record())
+			return false;
+	} while (fields.size() == 1 && fields[0].empty() && !quoted[0]); // skip blank lines
+
+	if (fields.size() != row.size())
+		throw formatted_error("{}: line {} has {} fields, expected {}.", fn.string(), line - 1, fields.size(), row.size());
+
+	for (size_t i = 0; i < row.size(); i++) {
+		auto& c = row[i];
+
+		c.is_null = fields[i].empty() && !quoted[i];
+
+		if (c.is_null) {
+			c.val.clear();
+			continue;
+		}
+
+		try {
+			parse_value(c, fields[i]);
+		} catch (const exception& e) {
+			throw formatted_error("{}: line {}, column {}: {}", fn.string(), line - 1, i + 1, e.what());
+		}
+	}
+
+	return true;
+}
+
+void csv_source::add_row(row_batch& b) {
+	b.add_row(row);
+}
+
+void csv_source::close() noexcept {
+	f.close();
+}
+
+binary_source::binary_source(const filesystem::path& fn) : fn(fn), buf(FILE_BUFFER_SIZE) {
+}
+
+template<typename T>
+static T read_le(istream& f, const filesystem::path& fn) {
+	T t;
+
+	if (!f.read((char*)&t, sizeof(t)))
+		throw formatted_error("{} is truncated.", fn.string());
+
+	return t;
+}
+
+template<typename T>
+static void write_le(ostream& f, T t) {
+	f.write((const char*)&t, sizeof(t));
+}
+
+vector<tds::column> binary_source::open() {
+	f.rdbuf()->pubsetbuf(buf.data(), (streamsize)buf.size());
+	f.open(fn, ios::binary);
+
+	if (!f.is_open())
+		throw formatted_error("Could not open {}.", fn.string());
+
+	char magic[sizeof(BINARY_MAGIC)];
+
+	if (!f.read(magic, sizeof(magic)) || memcmp(magic, BINARY_MAGIC, sizeof(magic)))
+		throw formatted_error("{} is not a comparer binary file.", fn.string());
+
+	if (auto version = read_le<uint16_t>(f, fn); version != BINARY_VERSION)
+		throw formatted_error("{} has unsupported version {}.", fn.string(), version);
+
+	auto num_cols = read_le<uint16_t>(f, fn);
+	vector<tds::column> cols(num_cols);
+
+	for (auto& c : cols) {
+		uint32_t coll;
+
+		c.type = (tds::sql_type)read_le<uint8_t>(f, fn);
+		c.max_length = read_le<uint32_t>(f, fn);
+		c.precision = read_le<uint8_t>(f, fn);
+		c.scale = read_le<uint8_t>(f, fn);
+		coll = read_le<uint32_t>(f, fn);
+		memcpy(&c.coll, &coll, sizeof(coll));
+		c.coll.sort_id = read_le<uint8_t>(f, fn);
+		c.nullable = true;
+		c.is_null = false;
+
+		c.name.resize(read_le<uint16_t>(f, fn));
+
+		if (!f.read((char*)c.name.data(), (streamsize)(c.name.size() * sizeof(char16_t))))
+			throw formatted_error("{} is truncated.", fn.string());
+	}
+
+	row = cols;
+
+	return cols;
+}
+
+bool binary_source::fetch_row() {
+	if (f.peek() == char_traits<char>::eof())
+		return false;
+
+	for (auto& c : row) {
+		auto len = read_le<uint32_t>(f, fn);
+
+		c.is_null = len == BINARY_NULL;
+
+		if (c.is_null) {
+			c.val.clear();
+			continue;
+		}
+
+		c.val.resize(len);
+
+		if (!f.read((char*)c.val.data(), len))
+			throw formatted_error("{} is truncated.", fn.string());
+	}
+
+	return true;
+}
+
+void binary_source::add_row(row_batch& b) {
+	b.add_row(row);
+}
+
+void binary_source::close() noexcept {
+	f.close();
+}
+
+binary_writer::binary_writer(const filesystem::path& fn, span<const tds::column> cols) : buf(FILE_BUFFER_SIZE) {
+	f.rdbuf()->pubsetbuf(buf.data(), (streamsize)buf.size());
+	f.exceptions(ios::failbit | ios::badbit);
+	f.open(fn, ios::binary | ios::trunc);
+
+	f.write(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+	write_le(f, BINARY_VERSION);
+	write_le(f, (uint16_t)cols.size());
+
+	for (const auto& c : cols) {
+		uint32_t coll;
+
+		memcpy(&coll, &c.coll, sizeof(coll));
+
+		write_le(f, (uint8_t)c.type);
+		write_le(f, (uint32_t)c.max_length);
+		write_le(f, c.precision);
+		write_le(f, c.scale);
+		write_le(f, coll);
+		write_le(f, c.coll.sort_id);
+		write_le(f, (uint16_t)c.name.size());
+		f.write((const char*)c.name.data(), (streamsize)(c.name.size() * sizeof(char16_t)));
+	}
+}
+
+void binary_writer::write_row(span<const tds::column> row) {
+	for (const auto& c : row) {
+		if (c.is_null) {
+			write_le(f, BINARY_NULL);
+			continue;
+		}
+
+		write_le(f, (uint32_t)c.val.size());
+		f.write((const char*)c.val.data(), (streamsize)c.val.size());
+	}
+}
+
+// Works out what sort of file it is from its first few bytes, falling back to CSV.
+
+unique_ptr<row_source> open_file_source(const filesystem::path& fn) {
+	char magic[4] = {};
+
+	{
+		ifstream f(fn, ios::binary);
+
+		if (!f.is_open())
+			throw formatted_error("Could not open {}.", fn.string());
+
+		f.read(magic, sizeof(magic));
+	}
+
+	if (!memcmp(magic, BINARY_MAGIC, sizeof(magic)))
+		return make_unique<binary_source>(fn);
+	else if (!memcmp(magic, "CMPS", sizeof(magic)))
+		return make_unique<snapshot_source>(fn);
+	else
+		return make_unique<csv_source>(fn);
+}
@@ -0,0 +1,315 @@
+#include "comparer.h"
+
+using namespace std;
+
+// In unsorted mode the queries have no ORDER BY, so that the servers don't have to sort
+// anything. Instead each side is split into partitions by a hash of its keys, and once a
+// side is holding more than its share of the memory budget its biggest partitions get
+// written out as snapshots. Each pair of partitions is then sorted here, and merged as
+// usual.
+
+static constexpr unsigned int UNSORTED_PARTITIONS = 64;
+
+vector<tds::column> partition_source::open() {
+	return cols;
+}
+
+bool partition_source::fetch_row() {
+	if (next_row == order.size())
+		return false;
+
+	current = next_row++;
+
+	return true;
+}
+
+void partition_source::add_row(row_batch& b) {
+	auto [batch, row] = order[current];
+
+	b.add_row(*batches[batch], row);
+}
+
+void partition_source::close() noexcept {
+	batches.clear();
+	order.clear();
+}
+
+// where the spilled partitions go, which is removed along with everything in it afterwards
+
+struct spill_directory {
+	~spill_directory() {
+		error_code ec;
+
+		filesystem::remove_all(path, ec);
+	}
+
+	filesystem::path path;
+};
+
+struct unsorted_side {
+	struct partition {
+		vector<shared_ptr<row_batch>> batches;
+		size_t bytes = 0;
+		filesystem::path spill_fn;
+		optional<snapshot_writer> spill;
+		budget_charge charge;
+	};
+
+	unsorted_side(const filesystem::path& dir, unsigned int side, const vector<tds::column>& cols, size_t limit);
+	void read(batch_cursor& s, const vector<bool>& int_keys);
+	void add_row(const row_batch& src, size_t row, unsigned int n);
+	void spill_largest();
+	void finish();
+	unique_ptr<partition_source> take(unsigned int n, const vector<bool>& int_keys);
+
+	filesystem::path dir;
+	unsigned int side;
+	vector<tds::column> cols;
+	vector<bool> fixed;
+	size_t limit;
+	size_t used = 0;
+	vector<partition> parts;
+};
+
+unsorted_side::unsorted_side(const filesystem::path& dir, unsigned int side, const vector<tds::column>& cols,
+							 size_t limit) : dir(dir), side(side), cols(cols), fixed(cols.size()), limit(limit),
+											 parts(UNSORTED_PARTITIONS) {
+	for (size_t i = 0; i < cols.size(); i++) {
+		fixed[i] = fixed_width_type(cols[i]).has_value();
+	}
+}
+
+void unsorted_side::read(batch_cursor& s, const vector<bool>& int_keys) {
+	if (s.finished)
+		return;
+
+	do {
+		const auto& b = s.batch();
+
+		for (size_t r = 0; r < b.num_rows; r++) {
+			auto h = hash_row(b, r, int_keys);
+
+			add_row(b, r, (unsigned int)((h ^ (h >> 32)) % UNSORTED_PARTITIONS));
+		}
+	} while (s.next_batch());
+}
+
+void unsorted_side::add_row(const row_batch& src, size_t row, unsigned int n) {
+	auto& p = parts[n];
+
+	if (p.batches.empty() || p.batches.back()->full()) {
+		if (!p.batches.empty()) {
+			p.batches.back()->seal();
+
+			// the partitions count against the memory budget along with everything else,
+			// so spill if the process as a whole is over it
+
+			p.charge.set(mem_budget, p.bytes);
+
+			if (mem_budget.in_use() > mem_budget.limit)
+				spill_largest();
+		}
+
+		p.batches.push_back(make_shared<row_batch>());
+		p.batches.back()->reset(fixed);
+	}
+
+	auto& b = *p.batches.back();
+	auto before = b.bytes;
+
+	b.add_row(src, row);
+
+	// roughly what the row takes up, with an offset for each column
+
+	auto size = b.bytes - before + (b.columns.size() * sizeof(size_t));
+
+	p.bytes += size;
+	used += size;
+
+	if (used > limit)
+		spill_largest();
+}
+
+void unsorted_side::spill_largest() {
+	auto& p = *max_element(parts.begin(), parts.end(), [](const partition& a, const partition& b) {
+		return a.bytes < b.bytes;
+	});
+
+	if (!p.spill) {
+		filesystem::create_directories(dir);
+
+		p.spill_fn = dir / format("{}-{}.snap", side, &p - parts.data());
+		p.spill.emplace(p.spill_fn);
+		p.spill->start(cols);
+	}
+
+	for (auto& b : p.batches) {
+		b->seal();
+		p.spill->write_batch(*b);
+	}
+
+	p.batches.clear();
+	p.charge.reset();
+	used -= p.bytes;
+	p.bytes = 0;
+}
+
+void unsorted_side::finish() {
+	for (auto& p : parts) {
+		if (!p.batches.empty())
+			p.batches.back()->seal();
+
+		if (p.spill)
+			p.spill->finish();
+	}
+}
+
+// Gathers a partition back up, from its snapshot if it was spilled and from memory, and
+// works out the order of its rows.
+
+unique_ptr<partition_source> unsorted_side::take(unsigned int n, const vector<bool>& int_keys) {
+	auto& p = parts[n];
+	vector<shared_ptr<row_batch>> batches;
+
+	if (p.spill) {
+		snapshot_source src(p.spill_fn);
+
+		src.open();
+
+		while (src.fetch_row()) {
+			auto b = make_shared<row_batch>();
+
+			src.read_batch(*b);
+			batches.push_back(b);
+		}
+	}
+
+	batches.insert(batches.end(), p.batches.begin(), p.batches.end());
+	p.batches.clear();
+	p.charge.reset();
+	used -= p.bytes;
+	p.bytes = 0;
+
+	// charged by the batch now, so that the budget's given back once the partition's merged
+
+	for (auto& b : batches) {
+		b->charge.set(mem_budget, b->bytes);
+	}
+
+	vector<pair<uint32_t, uint32_t>> order;
+
+	for (uint32_t i = 0; i < batches.size(); i++) {
+		for (uint32_t r = 0; r < batches[i]->num_rows; r++) {
+			order.emplace_back(i, r);
+		}
+	}
+
+	auto scratch1 = cols, scratch2 = cols;
+
+	sort(order.begin(), order.end(), [&](const pair<uint32_t, uint32_t>& a, const pair<uint32_t, uint32_t>& b) {
+		return compare_row_keys(*batches[a.first], a.second, *batches[b.first], b.second, int_keys,
+								scratch1, scratch2) < 0;
+	});
+
+	return make_unique<partition_source>(cols, move(batches), move(order));
+}
+
+static void stop_queue(batch_queue& t) noexcept {
+	{
+		lock_guard<mutex> lg(t.lock);
+
+		t.finished = true;
+	}
+
+	t.cv.notify_all();
+	mem_budget.notify();
+}
+
+template<bool do_new>
+void compare_unsorted(batch_queue& t1, batch_queue& t2, diff_sink& b, compare_stats& stats,
+					  unsigned int num, unsigned int pk_columns, bool pk_only, const filesystem::path& spill_dir,
+					  size_t memory) {
+	batch_cursor s1(t1), s2(t2);
+
+	s1.next_batch();
+	s2.next_batch();
+
+	if (t1.cols.size() != t2.cols.size())
+		throw formatted_error("Streams have different numbers of columns ({} and {}).", t1.cols.size(), t2.cols.size());
+
+	// Rows are sent to partitions by the bytes of their keys, so apart from integers the
+	// keys have to be the same type on both sides. This also means that strings which
+	// are only equal by their collation, such as by differing in case, don't match.
+	//
+	// Without a primary key the whole row is the key, so that the merge pairs off identical
+	// rows and reports whichever side has more copies of one.
+
+	auto key_columns = pk_columns == 0 ? (unsigned int)t1.cols.size() : pk_columns;
+	vector<bool> int_keys(key_columns);
+
+	for (unsigned int i = 0; i < key_columns; i++) {
+		const auto& c1 = t1.cols[i];
+		const auto& c2 = t2.cols[i];
+
+		int_keys[i] = is_int_type(fixed_width_type(c1)) && is_int_type(fixed_width_type(c2));
+
+		if (!int_keys[i] && (c1.type != c2.type || fixed_width_type(c1) != fixed_width_type(c2) ||
+							 c1.precision != c2.precision || c1.scale != c2.scale)) {
+			throw formatted_error("Column {} has different types on each side, which unsorted mode can't match up.", i + 1);
+		}
+	}
+
+	spill_directory dir{spill_dir / format("comparer-{}-{}", num, chrono::system_clock::now().time_since_epoch().count())};
+
+	// memory is how much each side's partitions can hold before they start spilling
+
+	unsorted_side side1(dir.path, 1, t1.cols, memory);
+	unsorted_side side2(dir.path, 2, t2.cols, memory);
+
+	{
+		exception_ptr err;
+
+		{
+			jthread j([&]() noexcept {
+				try {
+					side2.read(s2, int_keys);
+				} catch (...) {
+					err = current_exception();
+					stop_queue(t1);
+				}
+			});
+
+			try {
+				side1.read(s1, int_keys);
+			} catch (...) {
+				stop_queue(t2);
+				throw;
+			}
+		}
+
+		if (err)
+			rethrow_exception(err);
+	}
+
+	side1.finish();
+	side2.finish();
+
+	for (unsigned int n = 0; n < UNSORTED_PARTITIONS; n++) {
+		auto p1 = side1.take(n, int_keys);
+		auto p2 = side2.take(n, int_keys);
+
+		if (p1->order.empty() && p2->order.empty())
+			continue;
+
+		sql_thread u1(move(p1)), u2(move(p2));
+
+		compare_range<do_new>(u1, u2, b, stats, num, pk_columns, pk_only, pk_columns == 0);
+	}
+}
+
+template void compare_unsorted<false>(batch_queue& t1, batch_queue& t2, diff_sink& b, compare_stats& stats,
+									  unsigned int num, unsigned int pk_columns, bool pk_only, const filesystem::path& spill_dir,
+									  size_t memory);
+template void compare_unsorted<true>(batch_queue& t1, batch_queue& t2, diff_sink& b, compare_stats& stats,
+									 unsigned int num, unsigned int pk_columns, bool pk_only, const filesystem::path& spill_dir,
+									 size_t memory);